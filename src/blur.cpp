@@ -0,0 +1,655 @@
+#include "blur.hpp"
+#include <algorithm> // for copy_n, min, max
+#include <cstddef>   // for size_t, ptrdiff_t
+#include <deque>     // for deque
+#include <vector>    // for vector
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h> // for __m128i, __m256i, _mm_add_epi32, _mm256_...
+#define DXP_BLUR_SIMD
+#endif
+
+///
+/// Largest radius blurred with SIMD.
+///
+/// Kernel sums are divided with float reciprocals. Quotients are exact
+/// while the rounding error stays below 0.5 / n, which holds for kernels of
+/// up to about 16000 pixels.
+///
+constexpr uint k_max_simd_radius = 8191;
+
+/**
+ * Channels of a pixel. Sums of a kernel are kept unshifted, so they fit
+ * into 32 bits for any kernel
+ */
+static inline uint32_t
+red (uint32_t p)
+{
+  return (p >> 16) & 0xFF;
+}
+
+static inline uint32_t
+green (uint32_t p)
+{
+  return (p >> 8) & 0xFF;
+}
+
+static inline uint32_t
+blue (uint32_t p)
+{
+  return p & 0xFF;
+}
+
+/**
+ * Divide channel sums of a kernel of n pixels and pack them into a pixel
+ */
+static inline uint32_t
+pack (uint32_t r, uint32_t g, uint32_t b, uint32_t n)
+{
+  return (r / n) << 16 | (g / n) << 8 | (b / n);
+}
+
+/**
+ * Apply a horizontal box filter (low pass) to the image. Reference version.
+ *
+ * Uses algorithm described here
+ * http://blog.ivank.net/fastest-gaussian-blur.html
+ * and here https://www.gamasutra.com/view/feature/3102
+ */
+void
+box_blur_horizontal_scalar (dxp_image_view<uint32_t> image, uint radius)
+{
+  const int width = image.width;
+
+  const uint n = radius * 2 + 1; ///< Amount of pixels in a kernel
+
+  for (int y = 0; y < image.height; y++)
+    {
+      uint32_t *row = image.row (y);
+
+      // Accumulators for color values
+      uint32_t r = 0;
+      uint32_t g = 0;
+      uint32_t b = 0;
+
+      /// Leftmost part of the kernel.
+      /// As changes to the image are made in place,
+      /// unchanged kernel values must be stored
+      std::deque<uint32_t> left_pixels{};
+
+      // Fill accumulators. Image gets mirrored for edge pixels
+      for (int x = int (radius); x > 0; x--)
+        {
+          r += 2 * red (row[x]);
+          g += 2 * green (row[x]);
+          b += 2 * blue (row[x]);
+
+          left_pixels.push_front (row[x]);
+        }
+
+      // Add the first pixel to the accumulators
+      r += red (row[0]);
+      g += green (row[0]);
+      b += blue (row[0]);
+
+      // Main loop.
+      // Set pixel to the accumulated value and increment accumulator
+      for (int x = 0; x < width - int (radius) - 1; x++)
+        {
+          left_pixels.push_back (row[x]);
+          row[x] = pack (r, g, b, n);
+
+          // Subtract leftmost
+          r -= red (left_pixels[0]);
+          g -= green (left_pixels[0]);
+          b -= blue (left_pixels[0]);
+
+          // Add rightmost
+          r += red (row[x + int (radius) + 1]);
+          g += green (row[x + int (radius) + 1]);
+          b += blue (row[x + int (radius) + 1]);
+
+          left_pixels.pop_front ();
+        }
+
+      // Mirror image for edge pixels
+      for (int i = 1, x = width - int (radius) - 1; x < width; x++)
+        {
+          left_pixels.push_back (row[x]);
+          row[x] = pack (r, g, b, n);
+
+          r -= red (left_pixels[0]);
+          g -= green (left_pixels[0]);
+          b -= blue (left_pixels[0]);
+
+          r += red (row[width - i]);
+          g += green (row[width - i]);
+          b += blue (row[width - i]);
+          i++;
+
+          left_pixels.pop_front ();
+        }
+    }
+}
+
+/**
+ * Apply a vertical box filter (low pass) to the image. Reference version.
+ */
+void
+box_blur_vertical_scalar (dxp_image_view<uint32_t> image, uint radius)
+{
+  const int width = image.width;
+  const int height = image.height;
+
+  const uint n = radius * 2 + 1;
+
+  for (int x = 0; x < width; x++)
+    {
+      uint32_t r = 0;
+      uint32_t g = 0;
+      uint32_t b = 0;
+
+      std::deque<uint32_t> top_pixels{};
+
+      for (int y = int (radius); y > 0; y--)
+        {
+          r += 2 * red (image (x, y));
+          g += 2 * green (image (x, y));
+          b += 2 * blue (image (x, y));
+
+          top_pixels.push_front (image (x, y));
+        }
+
+      r += red (image (x, 0));
+      g += green (image (x, 0));
+      b += blue (image (x, 0));
+
+      for (int y = 0; y < height - int (radius) - 1; y++)
+        {
+          top_pixels.push_back (image (x, y));
+          image (x, y) = pack (r, g, b, n);
+
+          r -= red (top_pixels[0]);
+          g -= green (top_pixels[0]);
+          b -= blue (top_pixels[0]);
+
+          r += red (image (x, y + int (radius) + 1));
+          g += green (image (x, y + int (radius) + 1));
+          b += blue (image (x, y + int (radius) + 1));
+
+          top_pixels.pop_front ();
+        }
+      for (int i = 1, y = height - int (radius) - 1; y < height; y++)
+        {
+          top_pixels.push_back (image (x, y));
+          image (x, y) = pack (r, g, b, n);
+
+          r -= red (top_pixels[0]);
+          g -= green (top_pixels[0]);
+          b -= blue (top_pixels[0]);
+
+          r += red (image (x, height - i));
+          g += green (image (x, height - i));
+          b += blue (image (x, height - i));
+          i++;
+
+          top_pixels.pop_front ();
+        }
+    }
+}
+
+#ifdef DXP_BLUR_SIMD
+
+///
+/// SIMD versions give results identical to the scalar ones, including the
+/// edges: after the mirrored left (top) edge pixels leave the kernel in the
+/// reverse order, and the right (bottom) edge adds pixels that may already
+/// be blurred. Sums of a kernel are always sums of 2 * radius + 1 pixels,
+/// so each channel sum is at most 255 * n.
+///
+/// Quotients are computed as (sum + 0.5) * (1 / n) in float. Sums are exact
+/// and the bias keeps the quotient at least 0.5 / n away from integers,
+/// which is way above the rounding error, so truncation gives sum / n.
+///
+
+/**
+ * Unpack pixel into four 32 bit channels. Alpha is dropped
+ */
+__attribute__ ((target ("sse2"))) static inline __m128i
+load_channels (uint32_t p)
+{
+  const __m128i zero = _mm_setzero_si128 ();
+  __m128i v = _mm_cvtsi32_si128 (int (p & 0x00FFFFFF));
+  v = _mm_unpacklo_epi8 (v, zero);
+  return _mm_unpacklo_epi16 (v, zero);
+}
+
+/**
+ * Divide four channel sums by the kernel size and pack them into a pixel
+ */
+__attribute__ ((target ("sse2"))) static inline uint32_t
+store_channels (__m128i sum, __m128 reciprocal)
+{
+  const __m128 half = _mm_set1_ps (0.5F);
+  __m128i q = _mm_cvttps_epi32 (
+      _mm_mul_ps (_mm_add_ps (_mm_cvtepi32_ps (sum), half), reciprocal));
+  q = _mm_packs_epi32 (q, q);
+  q = _mm_packus_epi16 (q, q);
+  return uint32_t (_mm_cvtsi128_si32 (q));
+}
+
+/**
+ * Divide sums of a channel of four pixels by the kernel size
+ */
+__attribute__ ((target ("sse2"))) static inline __m128i
+divide (__m128i sum, __m128 reciprocal)
+{
+  const __m128 half = _mm_set1_ps (0.5F);
+  return _mm_cvttps_epi32 (
+      _mm_mul_ps (_mm_add_ps (_mm_cvtepi32_ps (sum), half), reciprocal));
+}
+
+/**
+ * Horizontal blur with channels of a pixel in one SSE2 register.
+ *
+ * Row is copied before blurring, as pixels leaving the kernel are already
+ * overwritten.
+ */
+__attribute__ ((target ("sse2"))) static void
+box_blur_horizontal_sse2 (dxp_image_view<uint32_t> image, uint radius)
+{
+  const int width = image.width;
+  const int height = image.height;
+  const int r = int (radius);
+  const __m128 reciprocal = _mm_set1_ps (1.0F / float (2 * r + 1));
+
+  std::vector<uint32_t> buffer (size_t (image.width));
+  uint32_t *original = buffer.data ();
+
+  for (int y = 0; y < height; y++)
+    {
+      uint32_t *row = image.row (y);
+      std::copy_n (row, width, original);
+
+      // Fill accumulator. Image gets mirrored for edge pixels
+      __m128i sum = load_channels (original[0]);
+      for (int x = 1; x <= r; x++)
+        {
+          const __m128i p = load_channels (original[x]);
+          sum = _mm_add_epi32 (sum, _mm_add_epi32 (p, p));
+        }
+
+      for (int x = 0; x < width; x++)
+        {
+          row[x] = store_channels (sum, reciprocal);
+
+          // Entering pixel is read after the store, it may be the same one
+          const uint32_t leaving = x < r ? original[x + 1] : original[x - r];
+          const uint32_t entering = x < width - r - 1
+                                        ? row[x + r + 1]
+                                        : row[2 * width - r - 2 - x];
+
+          sum = _mm_add_epi32 (_mm_sub_epi32 (sum, load_channels (leaving)),
+                               load_channels (entering));
+        }
+    }
+}
+
+/**
+ * Channel sums of kernels of the top row. Image gets mirrored for edge
+ * pixels
+ */
+static void
+init_vertical_sums (dxp_image_view<const uint32_t> image, uint radius,
+                    int32_t *sum_r, int32_t *sum_g, int32_t *sum_b)
+{
+  const uint32_t *top = image.row (0);
+  for (int x = 0; x < image.width; x++)
+    {
+      sum_r[x] = int32_t ((top[x] >> 16) & 0xFF);
+      sum_g[x] = int32_t ((top[x] >> 8) & 0xFF);
+      sum_b[x] = int32_t (top[x] & 0xFF);
+    }
+  for (int y = 1; y <= int (radius); y++)
+    {
+      const uint32_t *row = image.row (y);
+      for (int x = 0; x < image.width; x++)
+        {
+          sum_r[x] += 2 * int32_t ((row[x] >> 16) & 0xFF);
+          sum_g[x] += 2 * int32_t ((row[x] >> 8) & 0xFF);
+          sum_b[x] += 2 * int32_t (row[x] & 0xFF);
+        }
+    }
+}
+
+/**
+ * Blur columns [x, width) of the row and move their kernels down.
+ * Used for columns that don't fill a register
+ */
+static void
+blur_vertical_tail (uint32_t *row, const uint32_t *entering,
+                    const uint32_t *leaving, int x, int width, int n,
+                    int32_t *sum_r, int32_t *sum_g, int32_t *sum_b)
+{
+  for (; x < width; x++)
+    {
+      row[x] = uint32_t (sum_r[x] / n) << 16 | uint32_t (sum_g[x] / n) << 8
+               | uint32_t (sum_b[x] / n);
+
+      sum_r[x] += int32_t ((entering[x] >> 16) & 0xFF)
+                  - int32_t ((leaving[x] >> 16) & 0xFF);
+      sum_g[x] += int32_t ((entering[x] >> 8) & 0xFF)
+                  - int32_t ((leaving[x] >> 8) & 0xFF);
+      sum_b[x] += int32_t (entering[x] & 0xFF) - int32_t (leaving[x] & 0xFF);
+    }
+}
+
+/**
+ * Vertical blur of four columns at a time with a channel per SSE2 register.
+ *
+ * Rows are processed from the top, so memory is read sequentially. Original
+ * rows are kept in a ring buffer until they leave the kernel.
+ */
+__attribute__ ((target ("sse2"))) static void
+box_blur_vertical_sse2 (dxp_image_view<uint32_t> image, uint radius)
+{
+  const int width = image.width;
+  const int height = image.height;
+  const int r = int (radius);
+  const int n = 2 * r + 1;
+  const __m128 reciprocal = _mm_set1_ps (1.0F / float (n));
+  const __m128i mask = _mm_set1_epi32 (0xFF);
+
+  std::vector<int32_t> sums (size_t (width) * 3);
+  int32_t *sum_r = sums.data ();
+  int32_t *sum_g = sum_r + width;
+  int32_t *sum_b = sum_g + width;
+  init_vertical_sums (image, radius, sum_r, sum_g, sum_b);
+
+  std::vector<uint32_t> ring (size_t (r + 1) * size_t (width));
+
+  for (int y = 0; y < height; y++)
+    {
+      uint32_t *row = image.row (y);
+      std::copy_n (row, width,
+                   ring.data () + std::ptrdiff_t (y % (r + 1)) * width);
+
+      const uint32_t *leaving
+          = y < r ? image.row (y + 1)
+                  : ring.data ()
+                        + std::ptrdiff_t ((y - r) % (r + 1)) * width;
+      const uint32_t *entering
+          = image.row (y < height - r - 1 ? y + r + 1 : 2 * height - r - 2 - y);
+
+      int x = 0;
+      for (; x + 4 <= width; x += 4)
+        {
+          auto *r_ptr = reinterpret_cast<__m128i *> (sum_r + x);
+          auto *g_ptr = reinterpret_cast<__m128i *> (sum_g + x);
+          auto *b_ptr = reinterpret_cast<__m128i *> (sum_b + x);
+          __m128i rs = _mm_loadu_si128 (r_ptr);
+          __m128i gs = _mm_loadu_si128 (g_ptr);
+          __m128i bs = _mm_loadu_si128 (b_ptr);
+
+          const __m128i blurred = _mm_or_si128 (
+              _mm_or_si128 (_mm_slli_epi32 (divide (rs, reciprocal), 16),
+                            _mm_slli_epi32 (divide (gs, reciprocal), 8)),
+              divide (bs, reciprocal));
+          _mm_storeu_si128 (reinterpret_cast<__m128i *> (row + x), blurred);
+
+          // Entering pixels are read after the store, they may be the same
+          const __m128i in = _mm_loadu_si128 (
+              reinterpret_cast<const __m128i *> (entering + x));
+          const __m128i out = _mm_loadu_si128 (
+              reinterpret_cast<const __m128i *> (leaving + x));
+
+          rs = _mm_add_epi32 (rs,
+                              _mm_and_si128 (_mm_srli_epi32 (in, 16), mask));
+          rs = _mm_sub_epi32 (rs,
+                              _mm_and_si128 (_mm_srli_epi32 (out, 16), mask));
+          gs = _mm_add_epi32 (gs,
+                              _mm_and_si128 (_mm_srli_epi32 (in, 8), mask));
+          gs = _mm_sub_epi32 (gs,
+                              _mm_and_si128 (_mm_srli_epi32 (out, 8), mask));
+          bs = _mm_add_epi32 (bs, _mm_and_si128 (in, mask));
+          bs = _mm_sub_epi32 (bs, _mm_and_si128 (out, mask));
+
+          _mm_storeu_si128 (r_ptr, rs);
+          _mm_storeu_si128 (g_ptr, gs);
+          _mm_storeu_si128 (b_ptr, bs);
+        }
+
+      blur_vertical_tail (row, entering, leaving, x, width, n, sum_r, sum_g,
+                          sum_b);
+    }
+}
+
+/**
+ * Unpack two pixels into eight 32 bit channels. Alpha is dropped
+ */
+__attribute__ ((target ("avx2"))) static inline __m256i
+load_channels2 (uint32_t p0, uint32_t p1)
+{
+  const __m128i pair = _mm_and_si128 (_mm_set_epi32 (0, 0, int (p1), int (p0)),
+                                      _mm_set1_epi32 (0x00FFFFFF));
+  return _mm256_cvtepu8_epi32 (pair);
+}
+
+/**
+ * Divide two pixels worth of channel sums by the kernel size and pack them
+ */
+__attribute__ ((target ("avx2"))) static inline void
+store_channels2 (__m256i sum, __m256 reciprocal, uint32_t &p0, uint32_t &p1)
+{
+  const __m256 half = _mm256_set1_ps (0.5F);
+  const __m256i q = _mm256_cvttps_epi32 (
+      _mm256_mul_ps (_mm256_add_ps (_mm256_cvtepi32_ps (sum), half),
+                     reciprocal));
+  __m128i packed = _mm_packs_epi32 (_mm256_castsi256_si128 (q),
+                                    _mm256_extracti128_si256 (q, 1));
+  packed = _mm_packus_epi16 (packed, packed);
+  p0 = uint32_t (_mm_cvtsi128_si32 (packed));
+  p1 = uint32_t (_mm_cvtsi128_si32 (_mm_srli_si128 (packed, 4)));
+}
+
+/**
+ * Divide sums of a channel of eight pixels by the kernel size
+ */
+__attribute__ ((target ("avx2"))) static inline __m256i
+divide8 (__m256i sum, __m256 reciprocal)
+{
+  const __m256 half = _mm256_set1_ps (0.5F);
+  return _mm256_cvttps_epi32 (
+      _mm256_mul_ps (_mm256_add_ps (_mm256_cvtepi32_ps (sum), half),
+                     reciprocal));
+}
+
+/**
+ * Horizontal blur of two rows at a time, with channels of a pixel from each
+ * row in a half of an AVX2 register
+ */
+__attribute__ ((target ("avx2"))) static void
+box_blur_horizontal_avx2 (dxp_image_view<uint32_t> image, uint radius)
+{
+  const int width = image.width;
+  const int height = image.height;
+  const int r = int (radius);
+  const __m256 reciprocal = _mm256_set1_ps (1.0F / float (2 * r + 1));
+
+  std::vector<uint32_t> buffer (size_t (width) * 2);
+  uint32_t *original0 = buffer.data ();
+  uint32_t *original1 = original0 + width;
+
+  int y = 0;
+  for (; y + 2 <= height; y += 2)
+    {
+      uint32_t *row0 = image.row (y);
+      uint32_t *row1 = image.row (y + 1);
+      std::copy_n (row0, width, original0);
+      std::copy_n (row1, width, original1);
+
+      __m256i sum = load_channels2 (original0[0], original1[0]);
+      for (int x = 1; x <= r; x++)
+        {
+          const __m256i p = load_channels2 (original0[x], original1[x]);
+          sum = _mm256_add_epi32 (sum, _mm256_add_epi32 (p, p));
+        }
+
+      for (int x = 0; x < width; x++)
+        {
+          store_channels2 (sum, reciprocal, row0[x], row1[x]);
+
+          const int out = x < r ? x + 1 : x - r;
+          const int in = x < width - r - 1 ? x + r + 1 : 2 * width - r - 2 - x;
+
+          sum = _mm256_sub_epi32 (
+              sum, load_channels2 (original0[out], original1[out]));
+          sum = _mm256_add_epi32 (sum, load_channels2 (row0[in], row1[in]));
+        }
+    }
+
+  // Last row of an odd image
+  if (y < height)
+    {
+      box_blur_horizontal_sse2 (image.crop (0, y, width, 1), radius);
+    }
+}
+
+/**
+ * Vertical blur of eight columns at a time with a channel per AVX2 register
+ */
+__attribute__ ((target ("avx2"))) static void
+box_blur_vertical_avx2 (dxp_image_view<uint32_t> image, uint radius)
+{
+  const int width = image.width;
+  const int height = image.height;
+  const int r = int (radius);
+  const int n = 2 * r + 1;
+  const __m256 reciprocal = _mm256_set1_ps (1.0F / float (n));
+  const __m256i mask = _mm256_set1_epi32 (0xFF);
+
+  std::vector<int32_t> sums (size_t (width) * 3);
+  int32_t *sum_r = sums.data ();
+  int32_t *sum_g = sum_r + width;
+  int32_t *sum_b = sum_g + width;
+  init_vertical_sums (image, radius, sum_r, sum_g, sum_b);
+
+  std::vector<uint32_t> ring (size_t (r + 1) * size_t (width));
+
+  for (int y = 0; y < height; y++)
+    {
+      uint32_t *row = image.row (y);
+      std::copy_n (row, width,
+                   ring.data () + std::ptrdiff_t (y % (r + 1)) * width);
+
+      const uint32_t *leaving
+          = y < r ? image.row (y + 1)
+                  : ring.data ()
+                        + std::ptrdiff_t ((y - r) % (r + 1)) * width;
+      const uint32_t *entering
+          = image.row (y < height - r - 1 ? y + r + 1 : 2 * height - r - 2 - y);
+
+      int x = 0;
+      for (; x + 8 <= width; x += 8)
+        {
+          auto *r_ptr = reinterpret_cast<__m256i *> (sum_r + x);
+          auto *g_ptr = reinterpret_cast<__m256i *> (sum_g + x);
+          auto *b_ptr = reinterpret_cast<__m256i *> (sum_b + x);
+          __m256i rs = _mm256_loadu_si256 (r_ptr);
+          __m256i gs = _mm256_loadu_si256 (g_ptr);
+          __m256i bs = _mm256_loadu_si256 (b_ptr);
+
+          const __m256i blurred = _mm256_or_si256 (
+              _mm256_or_si256 (
+                  _mm256_slli_epi32 (divide8 (rs, reciprocal), 16),
+                  _mm256_slli_epi32 (divide8 (gs, reciprocal), 8)),
+              divide8 (bs, reciprocal));
+          _mm256_storeu_si256 (reinterpret_cast<__m256i *> (row + x), blurred);
+
+          const __m256i in = _mm256_loadu_si256 (
+              reinterpret_cast<const __m256i *> (entering + x));
+          const __m256i out = _mm256_loadu_si256 (
+              reinterpret_cast<const __m256i *> (leaving + x));
+
+          rs = _mm256_add_epi32 (
+              rs, _mm256_and_si256 (_mm256_srli_epi32 (in, 16), mask));
+          rs = _mm256_sub_epi32 (
+              rs, _mm256_and_si256 (_mm256_srli_epi32 (out, 16), mask));
+          gs = _mm256_add_epi32 (
+              gs, _mm256_and_si256 (_mm256_srli_epi32 (in, 8), mask));
+          gs = _mm256_sub_epi32 (
+              gs, _mm256_and_si256 (_mm256_srli_epi32 (out, 8), mask));
+          bs = _mm256_add_epi32 (bs, _mm256_and_si256 (in, mask));
+          bs = _mm256_sub_epi32 (bs, _mm256_and_si256 (out, mask));
+
+          _mm256_storeu_si256 (r_ptr, rs);
+          _mm256_storeu_si256 (g_ptr, gs);
+          _mm256_storeu_si256 (b_ptr, bs);
+        }
+
+      blur_vertical_tail (row, entering, leaving, x, width, n, sum_r, sum_g,
+                          sum_b);
+    }
+}
+
+#endif /* ifdef DXP_BLUR_SIMD */
+
+/**
+ * Apply a horizontal box filter (low pass) to the image.
+ *
+ * Uses SSE2 or AVX2 if the CPU supports them. Result is identical to
+ * box_blur_horizontal_scalar.
+ */
+void
+box_blur_horizontal (dxp_image_view<uint32_t> image, uint radius)
+{
+  // Mirrored kernel must fit into the line
+  radius = std::min (radius, uint (std::max (image.width - 1, 0)));
+
+#ifdef DXP_BLUR_SIMD
+  if (radius <= k_max_simd_radius)
+    {
+      if (__builtin_cpu_supports ("avx2"))
+        {
+          box_blur_horizontal_avx2 (image, radius);
+          return;
+        }
+      if (__builtin_cpu_supports ("sse2"))
+        {
+          box_blur_horizontal_sse2 (image, radius);
+          return;
+        }
+    }
+#endif
+  box_blur_horizontal_scalar (image, radius);
+}
+
+/**
+ * Apply a vertical box filter (low pass) to the image.
+ *
+ * Uses SSE2 or AVX2 if the CPU supports them. Result is identical to
+ * box_blur_vertical_scalar.
+ */
+void
+box_blur_vertical (dxp_image_view<uint32_t> image, uint radius)
+{
+  // Mirrored kernel must fit into the line
+  radius = std::min (radius, uint (std::max (image.height - 1, 0)));
+
+#ifdef DXP_BLUR_SIMD
+  if (radius <= k_max_simd_radius)
+    {
+      if (__builtin_cpu_supports ("avx2"))
+        {
+          box_blur_vertical_avx2 (image, radius);
+          return;
+        }
+      if (__builtin_cpu_supports ("sse2"))
+        {
+          box_blur_vertical_sse2 (image, radius);
+          return;
+        }
+    }
+#endif
+  box_blur_vertical_scalar (image, radius);
+}
@@ -0,0 +1,33 @@
+#ifndef DXP_BLUR_HPP
+#define DXP_BLUR_HPP
+
+#include "image.hpp"   // for dxp_image_view
+#include <cstdint>     // for uint32_t
+#include <sys/types.h> // for uint
+
+/**
+ * Apply a horizontal box filter (low pass) to the image.
+ *
+ * Uses SSE2 or AVX2 if the CPU supports them. Result is identical to
+ * box_blur_horizontal_scalar. Radius is limited to the size of the image.
+ */
+void box_blur_horizontal (dxp_image_view<uint32_t> image, uint radius);
+/**
+ * Apply a vertical box filter (low pass) to the image.
+ *
+ * Uses SSE2 or AVX2 if the CPU supports them. Result is identical to
+ * box_blur_vertical_scalar. Radius is limited to the size of the image.
+ */
+void box_blur_vertical (dxp_image_view<uint32_t> image, uint radius);
+
+/**
+ * Apply a horizontal box filter (low pass) to the image. Reference version.
+ */
+void box_blur_horizontal_scalar (dxp_image_view<uint32_t> image,
+                                 uint radius);
+/**
+ * Apply a vertical box filter (low pass) to the image. Reference version.
+ */
+void box_blur_vertical_scalar (dxp_image_view<uint32_t> image, uint radius);
+
+#endif /* ifndef DXP_BLUR_HPP */
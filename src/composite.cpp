@@ -0,0 +1,407 @@
+#include "composite.hpp"
+#include "config.hpp"      // for resize_filter
+#include "desktop.hpp"     // for dxp_desktop, box_blur_horizontal
+#include "tune.hpp"        // for dxp_tuning
+#include "xcb_util.hpp"    // for check, get_atom, xcb_unique_ptr, xcb_error
+#include <algorithm>       // for max, min, find_if, copy, fill
+#include <cstdlib>         // for free
+#include <utility>         // for move
+#include <xcb/composite.h> // for xcb_composite_name_window_pixmap
+
+dxp_composite::dxp_composite (xcb_connection_t *c, xcb_window_t root)
+{
+  this->c = c;
+  this->root = root;
+
+  if (!is_available (c))
+    {
+      throw composite_error (
+          "Composite extension is not supported by the X server");
+    }
+
+  // Automatic redirection keeps the screen painted by the server and can be
+  // used together with a compositing manager
+  auto *e = xcb_request_check (
+      c, xcb_composite_redirect_subwindows_checked (
+             c, root, XCB_COMPOSITE_REDIRECT_AUTOMATIC));
+  if (e != nullptr)
+    {
+      std::free (e);
+      throw composite_error ("Could not redirect top level windows");
+    }
+
+  this->wallpaper_atom = get_atom (c, "_XROOTPMAP_ID");
+}
+
+dxp_composite::~dxp_composite ()
+{
+  for (const auto &w : this->windows)
+    {
+      release (w);
+    }
+  xcb_composite_unredirect_subwindows (this->c, this->root,
+                                       XCB_COMPOSITE_REDIRECT_AUTOMATIC);
+  xcb_flush (this->c);
+}
+
+/**
+ * Check if the server supports Composite with named pixmaps (version 0.2)
+ */
+bool
+dxp_composite::is_available (xcb_connection_t *c)
+{
+  const auto *ext = xcb_get_extension_data (c, &xcb_composite_id);
+  if (ext == nullptr || !ext->present)
+    {
+      return false;
+    }
+
+  xcb_generic_error_t *e = nullptr;
+  auto version = xcb_unique_ptr<xcb_composite_query_version_reply_t> (
+      xcb_composite_query_version_reply (
+          c, xcb_composite_query_version (c, 0, 4), &e));
+  std::free (e);
+
+  return version != nullptr
+         && (version->major_version > 0 || version->minor_version >= 2);
+}
+
+/**
+ * Update windows on structure changes and damage of their contents.
+ *
+ * Returns true if windows were mapped, moved or restacked, or the wallpaper
+ * was changed, so desktops have to be drawn again.
+ */
+bool
+dxp_composite::handle_event (xcb_generic_event_t *event, uint8_t damage_event)
+{
+  // Most significant bit is set for events sent by other clients
+  auto type = event->response_type & ~0x80;
+
+  switch (type)
+    {
+    case XCB_MAP_NOTIFY:
+    case XCB_UNMAP_NOTIFY:
+    case XCB_CONFIGURE_NOTIFY:
+    case XCB_DESTROY_NOTIFY:
+    case XCB_REPARENT_NOTIFY:
+    case XCB_CIRCULATE_NOTIFY:
+      this->restack = true;
+      return true;
+
+    case XCB_PROPERTY_NOTIFY:
+      if (reinterpret_cast<xcb_property_notify_event_t *> (event)->atom
+          == this->wallpaper_atom)
+        {
+          this->restack = true;
+          return true;
+        }
+      return false;
+
+    default:
+      break;
+    }
+
+  if (damage_event != 0 && type == damage_event)
+    {
+      const auto *notify
+          = reinterpret_cast<xcb_damage_notify_event_t *> (event);
+      for (auto &w : this->windows)
+        {
+          if (w.damage == notify->damage)
+            {
+              w.dirty = true;
+            }
+        }
+    }
+
+  return false;
+}
+
+/**
+ * Draw thumbnails of the windows on the desktop into its pixmap.
+ *
+ * Windows are drawn from the bottom to the top over the wallpaper. Only
+ * thumbnails of changed windows are made again.
+ */
+void
+dxp_composite::save (dxp_desktop &desktop)
+{
+  std::scoped_lock<std::mutex> guard (this->lock);
+
+  if (this->restack)
+    {
+      update_windows ();
+    }
+
+  const int pixmap_width = int (desktop.pixmap_width);
+  const int pixmap_height = int (desktop.pixmap_height);
+  auto *output = reinterpret_cast<uint32_t *> (desktop.pixmap.data ());
+
+  // Wallpaper pixmap may be smaller than the screen or already freed
+  auto &background = this->backgrounds[&desktop];
+  if (background.empty () && this->wallpaper != XCB_NONE)
+    {
+      try
+        {
+          background = downscale (this->wallpaper, desktop.x, desktop.y,
+                                  desktop.width, desktop.height,
+                                  pixmap_width, pixmap_height);
+        }
+      catch (const xcb_error &)
+        {
+          this->wallpaper = XCB_NONE;
+        }
+    }
+
+  if (background.size () == desktop.pixmap.size ())
+    {
+      std::copy (background.begin (), background.end (),
+                 desktop.pixmap.begin ());
+    }
+  else
+    {
+      std::fill (desktop.pixmap.begin (), desktop.pixmap.end (), 0);
+    }
+
+  for (auto &w : this->windows)
+    {
+      // Window position and size on the pixmap
+      const int left = (w.x - desktop.x) * pixmap_width / int (desktop.width);
+      const int top = (w.y - desktop.y) * pixmap_height / int (desktop.height);
+      const int width
+          = std::max (int (w.width) * pixmap_width / int (desktop.width), 1);
+      const int height
+          = std::max (int (w.height) * pixmap_height / int (desktop.height), 1);
+
+      if (left >= pixmap_width || top >= pixmap_height || left + width <= 0
+          || top + height <= 0)
+        {
+          continue;
+        }
+
+      if (w.dirty || w.pixmap_width != width || w.pixmap_height != height)
+        {
+          // Repairing before getting the image, so later changes are reported
+          xcb_damage_subtract (this->c, w.damage, XCB_NONE, XCB_NONE);
+          try
+            {
+              w.pixmap_data = downscale (w.pixmap, 0, 0, w.width, w.height,
+                                         width, height);
+            }
+          catch (const xcb_error &)
+            {
+              // Window was unmapped in the meantime and will be restacked
+              continue;
+            }
+          w.pixmap_width = width;
+          w.pixmap_height = height;
+          w.dirty = false;
+        }
+
+      // Parts outside of the desktop are clipped
+      const int x0 = std::max (left, 0);
+      const int x1 = std::min (left + width, pixmap_width);
+      const int y0 = std::max (top, 0);
+      const int y1 = std::min (top + height, pixmap_height);
+
+      const auto *input
+          = reinterpret_cast<const uint32_t *> (w.pixmap_data.data ());
+      for (int y = y0; y < y1; y++)
+        {
+          for (int x = x0; x < x1; x++)
+            {
+              output[y * pixmap_width + x]
+                  = input[(y - top) * width + (x - left)];
+            }
+        }
+    }
+}
+
+/**
+ * Forget wallpapers downscaled for the desktops.
+ *
+ * They are looked up by the address of the desktop, which changes when
+ * desktops are moved to a new list.
+ */
+void
+dxp_composite::forget_desktops ()
+{
+  std::scoped_lock<std::mutex> guard (this->lock);
+  this->backgrounds.clear ();
+}
+
+/**
+ * Query the window tree and update the list of windows.
+ *
+ * Thumbnails of windows that stayed viewable are kept. Pixmaps are named
+ * again for mapped and resized windows, as the server allocates new
+ * storage for them.
+ */
+void
+dxp_composite::update_windows ()
+{
+  xcb_generic_error_t *e = nullptr;
+  auto tree = xcb_unique_ptr<xcb_query_tree_reply_t> (
+      xcb_query_tree_reply (this->c, xcb_query_tree (this->c, this->root), &e));
+  check (e, "XCB error while getting window tree reply");
+
+  // Children are listed from the bottom to the top
+  const auto *children = xcb_query_tree_children (tree.get ());
+  const int len = xcb_query_tree_children_length (tree.get ());
+
+  // All requests are sent before waiting for replies
+  std::vector<xcb_get_window_attributes_cookie_t> attributes_cookies;
+  std::vector<xcb_get_geometry_cookie_t> geometry_cookies;
+  for (int i = 0; i < len; i++)
+    {
+      attributes_cookies.push_back (
+          xcb_get_window_attributes (this->c, children[i]));
+      geometry_cookies.push_back (xcb_get_geometry (this->c, children[i]));
+    }
+
+  std::vector<dxp_window_thumbnail> updated;
+  for (int i = 0; i < len; i++)
+    {
+      // Window may be destroyed after the tree was queried
+      auto attributes = xcb_unique_ptr<xcb_get_window_attributes_reply_t> (
+          xcb_get_window_attributes_reply (
+              this->c, attributes_cookies[size_t (i)], &e));
+      std::free (e);
+      auto geometry = xcb_unique_ptr<xcb_get_geometry_reply_t> (
+          xcb_get_geometry_reply (this->c, geometry_cookies[size_t (i)], &e));
+      std::free (e);
+
+      if (attributes == nullptr || geometry == nullptr
+          || attributes->map_state != XCB_MAP_STATE_VIEWABLE
+          || attributes->override_redirect != 0
+          || attributes->_class != XCB_WINDOW_CLASS_INPUT_OUTPUT
+          || (geometry->depth != 24 && geometry->depth != 32))
+        {
+          continue;
+        }
+
+      dxp_window_thumbnail w{};
+      auto old = std::find_if (
+          this->windows.begin (), this->windows.end (),
+          [&] (const auto &window) { return window.id == children[i]; });
+      if (old != this->windows.end ())
+        {
+          w = std::move (*old);
+          old->id = XCB_NONE; // Moved, should not be released
+        }
+      else
+        {
+          w.id = children[i];
+          w.damage = xcb_generate_id (this->c);
+          xcb_damage_create (this->c, w.damage, w.id,
+                             XCB_DAMAGE_REPORT_LEVEL_NON_EMPTY);
+        }
+
+      const uint16_t width = geometry->width + 2 * geometry->border_width;
+      const uint16_t height = geometry->height + 2 * geometry->border_width;
+      if (w.pixmap == XCB_NONE || width != w.width || height != w.height)
+        {
+          if (w.pixmap != XCB_NONE)
+            {
+              xcb_free_pixmap (this->c, w.pixmap);
+            }
+          w.pixmap = xcb_generate_id (this->c);
+          xcb_composite_name_window_pixmap (this->c, w.id, w.pixmap);
+          w.dirty = true;
+        }
+
+      w.x = geometry->x;
+      w.y = geometry->y;
+      w.width = width;
+      w.height = height;
+      updated.push_back (std::move (w));
+    }
+
+  // Windows that were unmapped or destroyed
+  for (const auto &w : this->windows)
+    {
+      if (w.id != XCB_NONE)
+        {
+          release (w);
+        }
+    }
+  this->windows = std::move (updated);
+
+  // Wallpaper setters store the pixmap they painted in a root property
+  auto property = xcb_unique_ptr<xcb_get_property_reply_t> (
+      xcb_get_property_reply (
+          this->c,
+          xcb_get_property (this->c, 0, this->root, this->wallpaper_atom,
+                            XCB_ATOM_PIXMAP, 0, 1),
+          &e));
+  std::free (e);
+
+  xcb_pixmap_t wallpaper = XCB_NONE;
+  if (property != nullptr
+      && xcb_get_property_value_length (property.get ())
+             == sizeof (xcb_pixmap_t))
+    {
+      wallpaper = *static_cast<xcb_pixmap_t *> (
+          xcb_get_property_value (property.get ()));
+    }
+  if (wallpaper != this->wallpaper)
+    {
+      this->wallpaper = wallpaper;
+      this->backgrounds.clear ();
+    }
+
+  this->restack = false;
+}
+
+/**
+ * Free server side resources of the window.
+ *
+ * Damage of a destroyed window is already freed by the server, the error
+ * is reported as an event and ignored.
+ */
+void
+dxp_composite::release (const dxp_window_thumbnail &window)
+{
+  xcb_free_pixmap (this->c, window.pixmap);
+  xcb_damage_destroy (this->c, window.damage);
+}
+
+/**
+ * Get area of the drawable, blur it and resize it to width x height
+ */
+std::vector<uint8_t>
+dxp_composite::downscale (xcb_drawable_t drawable, int16_t x, int16_t y,
+                          uint16_t area_width, uint16_t area_height,
+                          uint16_t width, uint16_t height)
+{
+  xcb_generic_error_t *e = nullptr;
+  auto reply = xcb_unique_ptr<xcb_get_image_reply_t> (xcb_get_image_reply (
+      this->c,
+      xcb_get_image (this->c, XCB_IMAGE_FORMAT_Z_PIXMAP, drawable, x, y,
+                     area_width, area_height, uint32_t (~0)),
+      &e));
+  check (e, "XCB error while getting window image reply");
+  const dxp_image_view<uint32_t> image (
+      reinterpret_cast<uint32_t *> (xcb_get_image_data (reply.get ())),
+      area_width, area_height);
+
+  std::vector<uint8_t> output (width * height * 4U);
+  const dxp_image_view<uint32_t> thumbnail (
+      reinterpret_cast<uint32_t *> (output.data ()), width, height);
+  const auto filter = dxp_tuning::current ().filter;
+  if (filter != resize_filter::blur)
+    {
+      dxp_desktop::resample (filter, image, thumbnail);
+      return output;
+    }
+
+  // To remove aliasing in the resulting image,
+  // a low pass filter should be used on the source.
+  const uint radius = area_width / width / 2;
+  box_blur_horizontal (image, radius);
+  box_blur_vertical (image, radius);
+
+  dxp_desktop::nn_resize (image, thumbnail);
+  return output;
+}
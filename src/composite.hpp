@@ -0,0 +1,122 @@
+#ifndef DXP_COMPOSITE_HPP
+#define DXP_COMPOSITE_HPP
+
+#include <cstdint>      // for uint8_t, int16_t, uint16_t
+#include <map>          // for map
+#include <mutex>        // for mutex
+#include <stdexcept>    // for runtime_error
+#include <string>       // for string
+#include <vector>       // for vector
+#include <xcb/damage.h> // for xcb_damage_damage_t
+#include <xcb/xcb.h>    // for xcb_connection_t, xcb_generic_event_t
+#include <xcb/xproto.h> // for xcb_window_t, xcb_pixmap_t
+
+class dxp_desktop;
+
+/**
+ * Downscaled contents of a top level window
+ */
+struct dxp_window_thumbnail
+{
+  xcb_window_t id;
+  xcb_pixmap_t pixmap = XCB_NONE;        ///< Off-screen storage of the window
+  xcb_damage_damage_t damage = XCB_NONE; ///< Reports changes of the contents
+  int16_t x;       ///< x coordinate of the top left corner of the border
+  int16_t y;       ///< y coordinate of the top left corner of the border
+  uint16_t width;  ///< Width including the border
+  uint16_t height; ///< Height including the border
+  bool dirty = true; ///< Contents changed since the thumbnail was made
+  std::vector<uint8_t> pixmap_data; ///< Thumbnail in the root window format
+  uint16_t pixmap_width = 0;
+  uint16_t pixmap_height = 0;
+};
+
+/**
+ * Builds desktop thumbnails from thumbnails of top level windows.
+ *
+ * Top level windows are redirected with Composite extension, so contents
+ * of every window are kept in its own pixmap even if the window is covered.
+ * Window thumbnails are only made again when DAMAGE reports a change of
+ * the window. Override redirect windows (menus, notifications and dxp
+ * itself) are left out.
+ */
+class dxp_composite
+{
+public:
+  /**
+   * Redirect top level windows and subscribe to their changes.
+   *
+   * Throws composite_error if the extension is not supported.
+   */
+  explicit dxp_composite (xcb_connection_t *c, xcb_window_t root);
+  ~dxp_composite ();
+
+  // Server side resources are owned by exactly one object
+  dxp_composite (const dxp_composite &other) = delete;
+  dxp_composite (dxp_composite &&other) noexcept = delete;
+  dxp_composite &operator= (const dxp_composite &other) = delete;
+  dxp_composite &operator= (dxp_composite &&other) = delete;
+
+  /**
+   * Check if the server supports Composite with named pixmaps (version 0.2)
+   */
+  static bool is_available (xcb_connection_t *c);
+
+  /**
+   * Update windows on structure changes and damage of their contents.
+   *
+   * Returns false if the event is not about top level windows.
+   */
+  bool handle_event (xcb_generic_event_t *event, uint8_t damage_event);
+
+  /**
+   * Draw thumbnails of the windows on the desktop into its pixmap
+   */
+  void save (dxp_desktop &desktop);
+
+  /**
+   * Forget wallpapers downscaled for the desktops. Has to be called when
+   * desktops are replaced
+   */
+  void forget_desktops ();
+
+private:
+  xcb_connection_t *c;
+  xcb_window_t root;
+  std::mutex lock; ///< Desktops are saved from several threads
+  bool restack = true; ///< Windows were mapped, moved or restacked
+  /// Viewable top level windows from the bottom to the top
+  std::vector<dxp_window_thumbnail> windows;
+  xcb_atom_t wallpaper_atom;             ///< _XROOTPMAP_ID
+  xcb_pixmap_t wallpaper = XCB_NONE;     ///< Pixmap set by wallpaper setters
+  /// Downscaled wallpaper under each desktop, until they are replaced
+  std::map<const dxp_desktop *, std::vector<uint8_t>> backgrounds;
+
+  /**
+   * Query the window tree and update the list of windows
+   */
+  void update_windows ();
+
+  /**
+   * Free server side resources of the window
+   */
+  void release (const dxp_window_thumbnail &window);
+
+  /**
+   * Get area of the drawable, blur it and resize it to width x height
+   */
+  std::vector<uint8_t> downscale (xcb_drawable_t drawable, int16_t x, int16_t y,
+                                  uint16_t area_width, uint16_t area_height,
+                                  uint16_t width, uint16_t height);
+};
+
+class composite_error : public std::runtime_error
+{
+public:
+  composite_error ()
+      : std::runtime_error ("Got an error while redirecting windows"){};
+  explicit composite_error (const std::string &msg)
+      : std::runtime_error (msg){};
+};
+
+#endif /* ifndef DXP_COMPOSITE_HPP */
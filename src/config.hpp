@@ -61,13 +61,196 @@ const uint16_t dxp_border_pres_width = 2; ///< Width of the preselection
 const uint dxp_border_width = 0; ///< dxp window border
 
 ///
-/// How often to take screenshots.
+/// Share of one CPU core the daemon may spend on refreshing screenshots of
+/// visible desktops. Desktops are also captured shortly after switching to
+/// them.
 ///
-/// Recommended value is 10 seconds.
+/// The refresh period is adjusted to the measured cost of a capture and the
+/// latency of the X server, so cheap captures happen more often. On battery
+/// dxp_battery_cpu_budget is used instead.
 ///
-/// NOTE: Setting timeout to values below 5 ms may severely increase CPU load.
+const double dxp_cpu_budget = 0.01;
+const double dxp_battery_cpu_budget = 0.0025;
+
+///
+/// Bounds of the refresh period.
+///
+/// NOTE: Setting minimum to values below 5 ms may severely increase CPU load.
+///
+const auto dxp_min_screenshot_period = std::chrono::milliseconds (500);
+const auto dxp_max_screenshot_period = std::chrono::seconds (60);
+
+///
+/// Captures are suspended while the screen saver is active or no key was
+/// pressed and no button was clicked for dxp_idle_timeout. They resume on
+/// the next input. Set to 0 to only suspend while the screen saver is active.
+///
+const auto dxp_idle_timeout = std::chrono::minutes (5);
+
+///
+/// Visible desktops are captured once the input stopped for this long, so
+/// thumbnails show what the user saw last.
+///
+const auto dxp_input_debounce = std::chrono::seconds (1);
+
+///
+/// Delay between switching to a desktop and taking its screenshot.
+///
+/// Gives window manager and applications time to redraw the desktop.
+/// Desktops that were left before the delay expired are not captured.
+///
+const auto dxp_settle_delay = std::chrono::milliseconds (300);
+
+///
+/// When dxp is started, visible desktops are recaptured while the other
+/// desktops are being sent. Cached screenshot of the current desktop is
+/// sent if the capture takes longer than this.
+///
+const auto dxp_refresh_deadline = std::chrono::milliseconds (100);
+
+///
+/// Clients that stop sending or receiving for this long are dropped, so a
+/// stuck dxp can't hold up the clients behind it or the daemon shutdown.
+///
+const auto dxp_client_timeout = std::chrono::seconds (2);
+
+///
+/// Build thumbnails from contents of top level windows with Composite
+/// extension instead of capturing the screen. Menus, notifications and dxp
+/// itself are left out and only windows that changed are downscaled again.
+///
+/// Requires DAMAGE extension. Works with and without a compositing manager.
+///
+const bool dxp_composite_capture = false;
+
+///
+/// Use DAMAGE extension to recapture only changed parts of the desktop.
+///
+/// Disable if your X server or driver doesn't report changes reliably.
+///
+const bool dxp_use_damage = true;
+
+///
+/// If DAMAGE is unavailable or disabled, a grid of small squares is sampled
+/// before each capture. Desktop is captured only if some of them changed or
+/// its screenshot is older than dxp_probe_max_age.
+///
+/// Probe is a lot cheaper than a capture, but may miss small changes.
+///
+const bool dxp_change_probe = true;
+const uint dxp_probe_grid = 16; ///< Number of squares in a row and a column
+const uint dxp_probe_size = 8;  ///< Side of a square
+const auto dxp_probe_max_age = std::chrono::seconds (60);
+
+///
+/// Screenshots are captured in horizontal bands of this height.
+/// Set to 0 to capture the whole desktop at once.
+///
+/// X server is busy while it sends the screenshot and may not respond to
+/// other applications, and the daemon has to store the whole screenshot.
+/// Smaller bands keep both short at the cost of a round trip per band.
+///
+const uint dxp_capture_band_height = 256;
+
+///
+/// How many bands to capture at once. Set to 0 to capture all of them.
+///
+/// Remaining bands are captured after dxp_band_delay, so capture of a large
+/// desktop is spread over time.
+///
+const uint dxp_bands_per_capture = 0;
+const auto dxp_band_delay = std::chrono::milliseconds (20);
+
+///
+/// With the blur filter, captured bands are blurred and sampled in square
+/// tiles of about this many bytes. Set to 0 to process the whole band at
+/// once.
+///
+/// Tiles that fit into the L2 cache are read from memory once, instead of
+/// once per blur pass and once more for sampling. Neighbouring tiles
+/// overlap by the blur radius, which is processed twice.
+///
+const uint dxp_tile_bytes = 256 * 1024;
+
+///
+/// Number of threads that blur and downscale screenshots, including the
+/// one that captures them. Set to 0 to use one per CPU core, or to 1 to do
+/// everything on the capturing thread.
+///
+/// Tiles and rows of the thumbnail are split between the threads.
+///
+const uint dxp_threads = 0;
+
+///
+/// Number of thumbnail sizes kept for each desktop. Each size is half of the
+/// previous one and is averaged from it, the first one is the configured
+/// size. Clients may ask for any of them, dxp draws the first one.
+///
+/// All of the smaller sizes together cost about a third of the first one.
+/// Set to 1 to keep only the configured size.
+///
+const uint dxp_pixmap_levels = 4;
+
+///
+/// Downscale screenshots on the X server with RENDER extension.
+///
+/// Only the downscaled screenshot is transferred from the X server, which is
+/// much cheaper than transferring and downscaling the whole desktop.
+/// Quality depends on the filter and its implementation in the X server.
+///
+const bool dxp_render_downscale = false;
+
+///
+/// RENDER filter used for downscaling. Usually one of:
+/// "nearest", "bilinear", "fast", "good", "best", "convolution"
+///
+/// "convolution" averages all of the pixels covered by the thumbnail pixel.
+/// It looks the best, but is the slowest.
+///
+const std::string dxp_render_filter = "good";
+
+///
+/// Algorithm that downscales screenshots on the client side:
+///
+/// area:     thumbnail pixel is the average of the desktop pixels it covers.
+///           Each desktop pixel is read once or twice.
+/// blur:     box blur followed by nearest neighbour sampling. Blur is
+///           computed for every desktop pixel, but only a few of them are
+///           sampled.
+/// bilinear: triangle filter stretched over the covered pixels. Slightly
+///           softer than area.
+/// bicubic:  Catmull-Rom filter. Sharper, each desktop pixel is read about
+///           four times.
+/// lanczos2: Lanczos filter with 2 lobes. Similar to bicubic.
+/// lanczos3: Lanczos filter with 3 lobes. Sharpest and the slowest, each
+///           desktop pixel is read about six times.
+///
+/// Filters other than blur compute their weights once per desktop size.
+///
+enum class resize_filter
+{
+  area,
+  blur,
+  bilinear,
+  bicubic,
+  lanczos2,
+  lanczos3,
+};
+const resize_filter dxp_resize_filter = resize_filter::area;
+
+///
+/// Autotune:
+/// Measure filters, tile sizes and thread counts on synthetic frames of the
+/// size of your desktops at startup and use the fastest combination instead
+/// of dxp_resize_filter, dxp_tile_bytes and dxp_threads.
+///
+/// Only filters in dxp_autotune_filters are tried, so list the ones that
+/// look good enough to you. The choice is cached in ~/.cache/dxp/autotune
+/// for the CPU and desktop sizes, delete the file to measure again.
 ///
-const auto dxp_screenshot_period = std::chrono::seconds (10);
+const bool dxp_autotune = false;
+const std::vector<resize_filter> dxp_autotune_filters
+    = { resize_filter::area, resize_filter::blur };
 
 ///
 /// Desktop viewport:
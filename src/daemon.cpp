@@ -1,12 +1,32 @@
 #include "daemon.hpp"
-#include "config.hpp"               // for dxp_viewport, dxp_screenshot_period
-#include <bits/this_thread_sleep.h> // for sleep_for
-#include <cstddef>                  // for size_t
-#include <cstdint>                  // for uint8_t
-#include <functional>               // for ref
-#include <memory>                   // for allocator_traits<>::value_type
-#include <stdexcept>                // for runtime_error
-#include <thread>                   // for thread
+#include "config.hpp"        // for dxp_viewport, dxp_settle_delay, dxp_auto...
+#include "loop.hpp"          // for dxp_loop
+#include "pool.hpp"          // for dxp_pool
+#include "tune.hpp"          // for dxp_tuning
+#include <algorithm>         // for min, none_of
+#include <array>             // for array
+#include <cerrno>            // for errno, EAGAIN, EINTR, ECONNABORTED
+#include <chrono>            // for steady_clock, milliseconds
+#include <cstddef>           // for size_t
+#include <cstdint>           // for uint8_t, uint32_t
+#include <cstdlib>           // for free
+#include <cstring>           // for strerror
+#include <exception>         // for exception_ptr, current_exception, ret...
+#include <iostream>          // for operator<<, endl, basic_ostream
+#include <memory>            // for make_shared, allocator_traits<>::val...
+#include <mutex>             // for scoped_lock, unique_lock
+#include <stdexcept>         // for runtime_error
+#include <stop_token>        // for stop_token
+#include <thread>            // for jthread
+#include <unistd.h>          // for close
+#include <utility>           // for move
+#include <xcb/damage.h>      // for xcb_damage_notify_event_t
+#include <xcb/randr.h>       // for xcb_randr_select_input, xcb_randr_id
+#include <xcb/screensaver.h> // for xcb_screensaver_notify_event_t
+#include <xcb/xinput.h>      // for xcb_input_xi_select_events
+
+/// Time the listening socket is left out of the loop after accepting failed
+constexpr auto k_accept_retry_delay = std::chrono::milliseconds (500);
 
 dxp_daemon::dxp_daemon ()
 {
@@ -16,6 +36,19 @@ dxp_daemon::dxp_daemon ()
 
   auto desktops_info = get_desktops (this->c, this->root);
 
+  // Settings of the image kernels have to be known before the desktops
+  // compute their filters and the pool starts
+  if (dxp_autotune)
+    {
+      std::vector<std::array<uint, 4>> sizes;
+      for (const auto &d : desktops_info)
+        {
+          const auto size = dxp_desktop::thumbnail_size (d.width, d.height);
+          sizes.push_back ({ d.width, d.height, size[0], size[1] });
+        }
+      dxp_tuning::autotune (sizes);
+    }
+
   /* Initializing desktop objects. They are each binded to a separate
    * virtual desktop */
 
@@ -26,52 +59,881 @@ dxp_daemon::dxp_daemon ()
     }
 
   /* Initializing pixmaps that will be shared over socket They are a different
-   * datatype from the desktops as they don't store useless data.
-   *
-   * Copying only useful data from the desktop objects. */
+   * datatype from the desktops as they don't store useless data. */
 
+  dxp_snapshots::list shared;
   for (size_t i = 0; i < this->desktops.size (); i++)
     {
-      dxp_socket_desktop p;
+      shared.push_back (
+          std::make_shared<const dxp_socket_desktop> (share_desktop (i)));
+    }
+  this->socket_desktops.publish (std::move (shared));
 
-      p.id = i;
-      p.pixmap_len = desktops[i].pixmap_width * desktops[i].pixmap_height * 4U;
-      p.width = desktops[i].pixmap_width;
-      p.height = desktops[i].pixmap_height;
+  init_visible ();
+  init_damage ();
+  init_composite ();
+  init_idle ();
+}
 
-      // Copying pixmap from desktops into socket pixmaps
-      p.pixmap = desktops[i].pixmap; // Should be as fast as memcpy
+/**
+ * Redirect top level windows if composite capture is enabled
+ */
+void
+dxp_daemon::init_composite ()
+{
+  if (!dxp_composite_capture)
+    {
+      return;
+    }
+
+  // Window thumbnails are made and drawn as 32 bit pixels
+  if (this->desktops.empty ()
+      || this->desktops[0].format != pixel_format::bgra8888)
+    {
+      std::cerr << "Composite capture supports only 24 and 32 bit visuals. "
+                   "Falling back to screen capture"
+                << std::endl;
+      return;
+    }
+
+  // Changes of windows are only known from their damage
+  if (this->damage == XCB_NONE)
+    {
+      std::cerr << "Composite capture requires DAMAGE extension. "
+                   "Falling back to screen capture"
+                << std::endl;
+      return;
+    }
 
-      socket_desktops.push_back (p);
+  try
+    {
+      this->composite = std::make_unique<dxp_composite> (this->c, this->root);
+    }
+  catch (const std::runtime_error &e)
+    {
+      std::cerr << e.what () << ". Falling back to screen capture"
+                << std::endl;
     }
 }
 
+/**
+ * Subscribe to screen saver activation and raw input events to suspend
+ * captures while the user is away.
+ *
+ * Without XInput captures are only suspended while the screen saver is
+ * active, as nothing would resume them after the idle timeout.
+ */
 void
-dxp_daemon::run ()
+dxp_daemon::init_idle ()
+{
+  const auto *saver = xcb_get_extension_data (this->c, &xcb_screensaver_id);
+  if (saver != nullptr && saver->present)
+    {
+      xcb_generic_error_t *e = nullptr;
+      auto version = xcb_unique_ptr<xcb_screensaver_query_version_reply_t> (
+          xcb_screensaver_query_version_reply (
+              this->c, xcb_screensaver_query_version (this->c, 1, 1), &e));
+      check (e, "XCB error while getting screen saver version reply");
+
+      this->screensaver_event = saver->first_event + XCB_SCREENSAVER_NOTIFY;
+      xcb_screensaver_select_input (this->c, this->root,
+                                    XCB_SCREENSAVER_EVENT_NOTIFY_MASK);
+    }
+
+  const auto *input = xcb_get_extension_data (this->c, &xcb_input_id);
+  if (input != nullptr && input->present)
+    {
+      // Raw events are only available since XInput 2.0
+      xcb_generic_error_t *e = nullptr;
+      auto version = xcb_unique_ptr<xcb_input_xi_query_version_reply_t> (
+          xcb_input_xi_query_version_reply (
+              this->c, xcb_input_xi_query_version (this->c, 2, 0), &e));
+      std::free (e);
+
+      if (version != nullptr && version->major_version >= 2)
+        {
+          // Raw events are reported regardless of the focused window.
+          // Pointer motion is left out as it would wake the daemon constantly
+          struct
+          {
+            xcb_input_event_mask_t head;
+            uint32_t mask;
+          } mask{ { XCB_INPUT_DEVICE_ALL_MASTER, 1 },
+                  XCB_INPUT_XI_EVENT_MASK_RAW_KEY_PRESS
+                      | XCB_INPUT_XI_EVENT_MASK_RAW_BUTTON_PRESS };
+          xcb_input_xi_select_events (this->c, this->root, 1, &mask.head);
+          this->input_opcode = input->major_opcode;
+        }
+    }
+
+  xcb_flush (this->c);
+}
+
+/**
+ * Check if the screen saver is active or no input came for
+ * dxp_idle_timeout
+ */
+bool
+dxp_daemon::is_idle ()
+{
+  if (this->screensaver_event == 0)
+    {
+      return false;
+    }
+
+  xcb_generic_error_t *e = nullptr;
+  auto info = xcb_unique_ptr<xcb_screensaver_query_info_reply_t> (
+      xcb_screensaver_query_info_reply (
+          this->c, xcb_screensaver_query_info (this->c, this->root), &e));
+  check (e, "XCB error while getting screen saver info reply");
+
+  if (info->state == XCB_SCREENSAVER_STATE_ON)
+    {
+      return true;
+    }
+
+  return this->input_opcode != 0 && dxp_idle_timeout.count () > 0
+         && std::chrono::milliseconds (info->ms_since_user_input)
+                >= dxp_idle_timeout;
+}
+
+/**
+ * Resume suspended captures and postpone the capture after the input
+ */
+void
+dxp_daemon::handle_input ()
+{
+  auto now = std::chrono::steady_clock::now ();
+
+  if (this->idle)
+    {
+      this->idle = false;
+      this->next_capture = now + dxp_settle_delay;
+    }
+
+  this->input_capture = now + dxp_input_debounce;
+}
+
+/**
+ * Mark desktops that are the only ones on their monitor as visible
+ */
+void
+dxp_daemon::init_visible ()
+{
+  for (uint i = 0; i < this->desktops.size (); i++)
+    {
+      uint on_monitor = 0;
+      for (const auto &d : this->desktops)
+        {
+          if (d.x == this->desktops[i].x && d.y == this->desktops[i].y)
+            {
+              on_monitor++;
+            }
+        }
+
+      if (on_monitor == 1)
+        {
+          this->visible.push_back (i);
+        }
+    }
+}
+
+/**
+ * Subscribe to changes of the number of desktops, their viewports and
+ * monitor configuration.
+ *
+ * Desktops set in dxp_viewport ignore the EWMH properties, but still follow
+ * the monitors.
+ */
+void
+dxp_daemon::init_topology ()
+{
+  if (dxp_viewport.empty ())
+    {
+      this->number_of_desktops_atom
+          = get_atom (this->c, "_NET_NUMBER_OF_DESKTOPS");
+      this->desktop_viewport_atom
+          = get_atom (this->c, "_NET_DESKTOP_VIEWPORT");
+    }
+
+  const auto *ext = xcb_get_extension_data (this->c, &xcb_randr_id);
+  if (ext == nullptr || !ext->present)
+    {
+      return;
+    }
+
+  // CRTC changes are only reported to clients of RandR 1.2
+  xcb_generic_error_t *e = nullptr;
+  auto version = xcb_unique_ptr<xcb_randr_query_version_reply_t> (
+      xcb_randr_query_version_reply (
+          this->c, xcb_randr_query_version (this->c, 1, 2), &e));
+  check (e, "XCB error while getting randr version reply");
+
+  // Monitors that are plugged, unplugged or moved change their CRTCs. Screen
+  // changes cover resizes of the whole screen
+  this->randr_event = ext->first_event;
+  xcb_randr_select_input (this->c, this->root,
+                          XCB_RANDR_NOTIFY_MASK_SCREEN_CHANGE
+                              | XCB_RANDR_NOTIFY_MASK_CRTC_CHANGE);
+  xcb_flush (this->c);
+}
+
+/**
+ * Fill the pixmap of a resized desktop from its old pixmap, so the desktop
+ * isn't blank until it is captured
+ */
+static void
+rescale_pixmap (const dxp_desktop &old, dxp_desktop &desktop)
+{
+  // Nearest neighbour works on 32 bit pixels only
+  if (old.format != pixel_format::bgra8888
+      || desktop.format != pixel_format::bgra8888)
+    {
+      return;
+    }
+
+  dxp_desktop::nn_resize (
+      { reinterpret_cast<const uint32_t *> (old.pixmap.data ()),
+        int (old.pixmap_width), int (old.pixmap_height),
+        old.pixmap_stride / 4 },
+      { reinterpret_cast<uint32_t *> (desktop.pixmap.data ()),
+        int (desktop.pixmap_width), int (desktop.pixmap_height),
+        desktop.pixmap_stride / 4 });
+  desktop.save_mips ();
+}
+
+/**
+ * Read desktops again and replace the ones that were added, removed or
+ * resized. Thumbnails of the other desktops are kept.
+ *
+ * EWMH identifies desktops by their index, so a desktop is kept if the
+ * desktop with the same index has the same geometry.
+ */
+void
+dxp_daemon::update_topology ()
+{
+  this->topology_changed = false;
+
+  // Window manager updates the properties one by one and monitors are
+  // reported one by one, so they may disagree for a while. They are read
+  // again after the next change
+  std::vector<desktop_info> info;
+  try
+    {
+      info = get_desktops (this->c, this->root);
+    }
+  catch (const std::runtime_error &e)
+    {
+      std::cerr << e.what () << "\nKeeping the previous desktops"
+                << std::endl;
+      hide_unplugged ();
+      return;
+    }
+  if (info.empty ())
+    {
+      return;
+    }
+
+  const auto shared = this->socket_desktops.load ();
+  std::vector<dxp_desktop> desktops;
+  dxp_snapshots::list snapshots (info.size ());
+  desktops.reserve (info.size ());
+
+  for (uint i = 0; i < info.size (); i++)
+    {
+      const auto &d = info[i];
+      const bool existed = i < this->desktops.size ();
+      if (existed && this->desktops[i].x == d.x && this->desktops[i].y == d.y
+          && this->desktops[i].width == d.width
+          && this->desktops[i].height == d.height)
+        {
+          desktops.push_back (std::move (this->desktops[i]));
+          if (i < shared->size ())
+            {
+              snapshots[i] = (*shared)[i];
+            }
+          continue;
+        }
+
+      // New desktops are captured when they are shown for the first time
+      desktops.emplace_back (d.x, d.y, d.width, d.height);
+      if (existed)
+        {
+          rescale_pixmap (this->desktops[i], desktops.back ());
+        }
+    }
+
+  this->desktops = std::move (desktops);
+  if (this->composite)
+    {
+      this->composite->forget_desktops ();
+    }
+  for (uint i = 0; i < snapshots.size (); i++)
+    {
+      if (!snapshots[i])
+        {
+          snapshots[i]
+              = std::make_shared<const dxp_socket_desktop> (share_desktop (i));
+        }
+    }
+  this->socket_desktops.publish (std::move (snapshots));
+
+  // Monitors may now show different desktops
+  this->visible.clear ();
+  init_visible ();
+  set_current_desktop (std::min (get_current_desktop (this->c, this->root),
+                                 uint (this->desktops.size ()) - 1));
+}
+
+/**
+ * Stop capturing desktops that don't fit on a monitor anymore.
+ *
+ * Images of the area outside of the root window can't be read, so the
+ * desktops are only captured again after they are read from a complete
+ * topology.
+ */
+void
+dxp_daemon::hide_unplugged ()
+{
+  std::vector<monitor_info> monitors;
+  try
+    {
+      monitors = get_monitors (this->c, this->root);
+    }
+  catch (const std::runtime_error &e)
+    {
+      std::cerr << e.what () << std::endl;
+    }
+
+  std::erase_if (this->visible, [&] (uint v) {
+    const auto &d = this->desktops[v];
+    return std::none_of (monitors.begin (), monitors.end (),
+                         [&] (const monitor_info &m) {
+                           return m.x == d.x && m.y == d.y
+                                  && m.width >= d.width
+                                  && m.height >= d.height;
+                         });
+  });
+}
+
+/**
+ * Subscribe to changes of the root window with DAMAGE extension.
+ * If extension is missing, desktops will be probed for changes instead.
+ */
+void
+dxp_daemon::init_damage ()
+{
+  if (!dxp_use_damage)
+    {
+      return;
+    }
+
+  const auto *ext = xcb_get_extension_data (this->c, &xcb_damage_id);
+  if (ext == nullptr || !ext->present)
+    {
+      std::cerr << "DAMAGE extension is not supported by the X server. "
+                   "Falling back to probing desktops for changes"
+                << std::endl;
+      return;
+    }
+
+  // Version has to be negotiated before using the extension
+  xcb_generic_error_t *e = nullptr;
+  auto version = xcb_unique_ptr<xcb_damage_query_version_reply_t> (
+      xcb_damage_query_version_reply (
+          this->c, xcb_damage_query_version (this->c, 1, 1), &e));
+  check (e, "XCB error while getting damage version reply");
+
+  this->damage_event = ext->first_event + XCB_DAMAGE_NOTIFY;
+  this->damage = xcb_generate_id (this->c);
+
+  // Delta rectangles are only reported for areas that were not damaged
+  // since the last subtract, so static screens generate no events
+  xcb_damage_create (this->c, this->damage, this->root,
+                     XCB_DAMAGE_REPORT_LEVEL_DELTA_RECTANGLES);
+  xcb_flush (this->c);
+}
+
+/**
+ * Update the current desktop and schedule its capture
+ */
+void
+dxp_daemon::set_current_desktop (uint id)
+{
+  if (!dxp_viewport.empty () && id >= dxp_viewport.size () / 2)
+    {
+      throw std::runtime_error (
+          "The amount of virtual desktops specified in the config does not "
+          "match the amount of your virtual deskops in your system.");
+    }
+
+  // New desktop replaces the one that was shown on its monitor
+  std::erase_if (this->visible, [&] (uint v) {
+    return this->desktops[v].x == this->desktops[id].x
+           && this->desktops[v].y == this->desktops[id].y;
+  });
+  this->visible.push_back (id);
+
+  // Screen contents were replaced since the desktop was last seen
+  this->idle = false;
+  this->current = id;
+  this->refresh.current = id;
+  this->desktops[id].damage_all ();
+
+  // Window manager may still be drawing the new desktop. Postponing capture
+  // also skips desktops that were only flipped through
+  this->next_capture = std::chrono::steady_clock::now () + dxp_settle_delay;
+}
+
+/**
+ * React to desktop switches and damage of the root window
+ */
+void
+dxp_daemon::handle_event (xcb_generic_event_t *event)
 {
-  // Start a server that will share pixmaps over socket in a separate thread
-  std::thread daemon_thread (&dxp_socket::send_desktops_on_event, &this->server,
-                             std::ref (this->socket_desktops),
-                             std::ref (this->socket_desktops_lock));
+  // Most significant bit is set for events sent by other clients
+  auto type = event->response_type & ~0x80;
+
+  // Windows were moved or restacked, so desktops have to be drawn again
+  if (this->composite
+      && this->composite->handle_event (event, this->damage_event))
+    {
+      for (auto id : this->visible)
+        {
+          this->desktops[id].damage_all ();
+        }
+    }
+
+  if (type == XCB_PROPERTY_NOTIFY)
+    {
+      const auto *notify
+          = reinterpret_cast<xcb_property_notify_event_t *> (event);
+      if (notify->atom == this->current_desktop_atom)
+        {
+          // Property may be rewritten with the same value. Desktop that was
+          // just added may become current before it is counted
+          auto id = get_current_desktop (this->c, this->root);
+          if (id >= this->desktops.size ())
+            {
+              this->topology_changed = true;
+            }
+          else if (id != this->current)
+            {
+              set_current_desktop (id);
+            }
+        }
+      else if (notify->atom == this->number_of_desktops_atom
+               || notify->atom == this->desktop_viewport_atom)
+        {
+          this->topology_changed = true;
+        }
+    }
+  else if (this->randr_event != 0
+           && (type == this->randr_event + XCB_RANDR_SCREEN_CHANGE_NOTIFY
+               || type == this->randr_event + XCB_RANDR_NOTIFY))
+    {
+      this->topology_changed = true;
+    }
+  else if (this->damage != XCB_NONE && type == this->damage_event)
+    {
+      const auto *notify
+          = reinterpret_cast<xcb_damage_notify_event_t *> (event);
+
+      // Damage of redirected windows is relative to the window
+      auto area = notify->area;
+      if (notify->drawable != this->root)
+        {
+          area.x += notify->geometry.x;
+          area.y += notify->geometry.y;
+        }
+
+      // Area is clipped to each of the desktops
+      for (auto id : this->visible)
+        {
+          this->desktops[id].add_damage (area);
+        }
+    }
+  else if (this->input_opcode != 0 && type == XCB_GE_GENERIC
+           && reinterpret_cast<xcb_ge_generic_event_t *> (event)->extension
+                  == this->input_opcode)
+    {
+      // Only raw key presses and button clicks were selected
+      handle_input ();
+    }
+  else if (this->screensaver_event != 0 && type == this->screensaver_event)
+    {
+      const auto *notify
+          = reinterpret_cast<xcb_screensaver_notify_event_t *> (event);
+
+      if (notify->state == XCB_SCREENSAVER_STATE_ON)
+        {
+          // Nothing to capture until the user comes back
+          this->idle = true;
+          this->input_capture = std::chrono::steady_clock::time_point::max ();
+        }
+      else if (notify->state == XCB_SCREENSAVER_STATE_OFF)
+        {
+          handle_input ();
+        }
+    }
+}
 
+/**
+ * Handle events of the loop until it's time to capture visible desktops,
+ * a client requested a fresh capture or the daemon is stopped
+ */
+void
+dxp_daemon::wait_for_capture ()
+{
   while (this->running)
     {
-      auto current = get_current_desktop (this->c, this->root);
-      if (!dxp_viewport.empty () && current >= dxp_viewport.size () / 2)
+      // Events may already be read from the socket and queued by xcb
+      while (auto event = xcb_unique_ptr<xcb_generic_event_t> (
+                 xcb_poll_for_event (this->c)))
+        {
+          handle_event (event.get ());
+        }
+
+      if (xcb_connection_has_error (this->c))
+        {
+          throw std::runtime_error ("Lost connection to the X server");
+        }
+
+      // Single change is reported by several events, desktops are read
+      // once after all of them. Reading them may queue more events, which
+      // are handled before waiting
+      if (this->topology_changed)
+        {
+          update_topology ();
+          continue;
+        }
+
+      // Clients are accepted again after a failure
+      if (this->accept_retry <= std::chrono::steady_clock::now ())
+        {
+          this->loop.watch (this->server.fd, dxp_loop::clients);
+          this->accept_retry = std::chrono::steady_clock::time_point::max ();
+        }
+
+      // Deadline may have been moved by the handled events.
+      // Suspended daemon sleeps until the next event
+      auto deadline = std::chrono::steady_clock::time_point::max ();
+      if (!this->idle)
+        {
+          deadline = std::min (this->next_capture, this->input_capture);
+          if (deadline <= std::chrono::steady_clock::now ())
+            {
+              return;
+            }
+        }
+      this->loop.set_deadline (std::min (deadline, this->accept_retry));
+
+      bool requested = false;
+      for (auto source : this->loop.wait ())
+        {
+          if (source == dxp_loop::clients)
+            {
+              accept_clients ();
+            }
+          // Client is waiting for the capture, even if the daemon is idle
+          else if (source == dxp_loop::refresh)
+            {
+              requested = true;
+            }
+          else if (source == dxp_loop::shutdown)
+            {
+              this->running = false;
+            }
+        }
+
+      if (requested)
+        {
+          return;
+        }
+    }
+}
+
+/**
+ * Queue pending connections for the thread that serves clients.
+ *
+ * Listening socket stays readable while accepting fails, for example when
+ * the daemon runs out of descriptors. It is taken out of the loop for
+ * k_accept_retry_delay instead of being retried right away.
+ */
+void
+dxp_daemon::accept_clients ()
+{
+  int error = 0;
+  {
+    std::scoped_lock<std::mutex> guard (this->clients_lock);
+    for (int fd = this->server.accept (); fd != -1;
+         fd = this->server.accept ())
+      {
+        this->clients.push_back (fd);
+      }
+    error = errno;
+  }
+  this->clients_cv.notify_one ();
+
+  // All pending connections were taken, or one was reset before it was
+  // accepted and the loop reports the rest again
+  if (error == EAGAIN || error == EINTR || error == ECONNABORTED)
+    {
+      return;
+    }
+
+  std::cerr << "Failed to accept a client: " << std::strerror (error)
+            << std::endl;
+  this->loop.unwatch (this->server.fd);
+  this->accept_retry
+      = std::chrono::steady_clock::now () + k_accept_retry_delay;
+}
+
+/**
+ * Serve clients accepted by the event loop until stopped.
+ *
+ * Clients wait for the capture they requested, so they can't be served by
+ * the loop that runs it. Errors of a client only end its connection.
+ * Connections time out, so a stuck client holds up the others and the
+ * shutdown for at most dxp_client_timeout.
+ */
+void
+dxp_daemon::serve_clients (const std::stop_token &stop)
+{
+  while (true)
+    {
+      int fd = -1;
+      {
+        std::unique_lock<std::mutex> guard (this->clients_lock);
+        this->clients_cv.wait (guard, stop,
+                               [&] { return !this->clients.empty (); });
+        if (stop.stop_requested ())
+          {
+            // Clients that weren't served yet are dropped on shutdown
+            for (int queued : this->clients)
+              {
+                close (queued);
+              }
+            this->clients.clear ();
+            return;
+          }
+        fd = this->clients.front ();
+        this->clients.pop_front ();
+      }
+
+      try
+        {
+          this->server.serve (fd, this->socket_desktops, this->refresh);
+        }
+      catch (const std::runtime_error &e)
+        {
+          std::cerr << e.what () << std::endl;
+        }
+      close (fd);
+    }
+}
+
+/**
+ * Recapture damaged parts of visible desktops, share the result and
+ * schedule the next capture.
+ *
+ * Desktops are updated by the threads of the shared pool, so their
+ * requests are in flight at the same time and blurring runs on separate
+ * cores.
+ */
+void
+dxp_daemon::capture ()
+{
+  this->scheduler.start ();
+
+  if (this->damage != XCB_NONE)
+    {
+      // Repair everything reported so far to get events for new damage
+      xcb_damage_subtract (this->c, this->damage, XCB_NONE, XCB_NONE);
+      xcb_flush (this->c);
+    }
+
+  // Tasks of the pool must not throw, errors are rethrown after all of
+  // the updates finish
+  const size_t count = this->visible.size ();
+  std::vector<uint8_t> updated (count);
+  std::vector<std::exception_ptr> errors (count);
+  dxp_pool::shared ().run (int (count), [&] (int i) {
+    try
+      {
+        const dxp_scheduler::task task;
+        updated[size_t (i)] = update_desktop (this->visible[size_t (i)]);
+        if (updated[size_t (i)] != 0)
+          {
+            this->scheduler.add (task);
+          }
+      }
+    catch (...)
+      {
+        errors[size_t (i)] = std::current_exception ();
+      }
+  });
+
+  bool captured = false;
+  bool pending = false;
+  for (size_t i = 0; i < count; i++)
+    {
+      auto id = this->visible[i];
+
+      if (errors[i])
+        {
+          try
+            {
+              std::rethrow_exception (errors[i]);
+            }
+          catch (const xcb_error &e)
+            {
+              // Monitor of the desktop was unplugged or moved before its
+              // events were handled
+              std::cerr << e.what () << "\nReading desktops again"
+                        << std::endl;
+              this->topology_changed = true;
+              continue;
+            }
+        }
+      if (updated[i] != 0)
+        {
+          // Clients that are being served keep the previous pixmap
+          this->socket_desktops.publish (id, share_desktop (id));
+          captured = true;
+        }
+
+      pending = pending || !this->desktops[id].damage.empty ();
+    }
+
+  // Refresh periodically until the next desktop switch
+  this->next_capture = std::chrono::steady_clock::now ()
+                       + this->scheduler.finish (captured);
+
+  this->input_capture = std::chrono::steady_clock::time_point::max ();
+
+  // Not all bands were captured
+  if (pending)
+    {
+      this->next_capture = std::chrono::steady_clock::now () + dxp_band_delay;
+    }
+  // Thumbnails show the last state the user saw, stop until they come back
+  else if (is_idle ())
+    {
+      this->idle = true;
+    }
+}
+
+/**
+ * Copy of the pixmaps of the desktop for the socket server.
+ *
+ * Only useful data of the desktop is copied.
+ */
+dxp_socket_desktop
+dxp_daemon::share_desktop (uint id) const
+{
+  const auto &desktop = this->desktops[id];
+  dxp_socket_desktop p;
+
+  p.id = id;
+  p.pixmap_len = desktop.pixmap.size ();
+  p.width = desktop.pixmap_width;
+  p.height = desktop.pixmap_height;
+  p.pixmap = desktop.pixmap; // Should be as fast as memcpy
+
+  for (const auto &mip : desktop.mips)
+    {
+      p.mips.push_back ({ id, uint16_t (mip.width), uint16_t (mip.height),
+                          uint32_t (mip.pixmap.size ()), mip.pixmap, {} });
+    }
+
+  return p;
+}
+
+/**
+ * Recapture damaged parts of the desktop.
+ *
+ * Returns false if the pixmap is already up to date.
+ */
+bool
+dxp_daemon::update_desktop (uint id)
+{
+  auto &desktop = this->desktops[id];
+
+  if (this->composite)
+    {
+      if (desktop.damage.empty ())
+        {
+          return false;
+        }
+
+      this->composite->save (desktop);
+      desktop.damage.clear ();
+      desktop.save_mips ();
+      return true;
+    }
+
+  if (this->damage == XCB_NONE)
+    {
+      // Cheap probe decides if the desktop has to be recaptured
+      if (!dxp_change_probe || desktop.probe ()
+          || std::chrono::steady_clock::now () - desktop.last_capture
+                 > dxp_probe_max_age)
         {
-          throw std::runtime_error (
-              "The amount of virtual desktops specified in the config does not "
-              "match the amount of your virtual deskops in your system.");
+          desktop.damage_all ();
         }
+    }
 
-      this->socket_desktops_lock.lock ();
-      this->desktops[current].save_screen ();
+  // Static screen. Thumbnail is already up to date
+  if (desktop.damage.empty ())
+    {
+      return false;
+    }
 
-      // Copying pixmap from desktops into socket pixmaps
-      this->socket_desktops[current].pixmap = this->desktops[current].pixmap;
+  desktop.save_damage ();
+  desktop.save_mips ();
+  return true;
+}
 
-      this->socket_desktops_lock.unlock ();
+/**
+ * Run the event loop until SIGINT or SIGTERM.
+ *
+ * X events, clients, capture requests and the capture timer are all
+ * handled on this thread. Clients are served by another one.
+ */
+void
+dxp_daemon::run ()
+{
+  this->loop.watch (xcb_get_file_descriptor (this->c), dxp_loop::x_server);
+  this->loop.watch (this->server.fd, dxp_loop::clients);
+  this->loop.watch (this->refresh.fd, dxp_loop::refresh);
+
+  // Stopped and joined when the loop ends, even by an exception
+  std::jthread server_thread (
+      [this] (const std::stop_token &stop) { serve_clients (stop); });
+
+  // Desktop switches are reported as changes of root window's property.
+  // Composite capture also follows structure changes of top level windows
+  const uint32_t mask
+      = XCB_EVENT_MASK_PROPERTY_CHANGE
+        | (this->composite ? XCB_EVENT_MASK_SUBSTRUCTURE_NOTIFY : 0);
+  xcb_change_window_attributes (this->c, this->root, XCB_CW_EVENT_MASK, &mask);
+  this->current_desktop_atom = get_atom (this->c, "_NET_CURRENT_DESKTOP");
+  init_topology ();
+
+  set_current_desktop (get_current_desktop (this->c, this->root));
+
+  while (this->running)
+    {
+      wait_for_capture ();
+      if (!this->running)
+        {
+          break;
+        }
 
-      std::this_thread::sleep_for (dxp_screenshot_period);
+      // Capture serves every request that came before it
+      auto ticket = this->refresh.take ();
+      capture ();
+      this->refresh.complete (ticket);
     };
 }
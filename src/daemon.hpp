@@ -1,32 +1,174 @@
 #ifndef DXP_DAEMON_HPP
 #define DXP_DAEMON_HPP
 
-#include "desktop.hpp"  // for dxp_desktop
-#include "socket.hpp"   // for dxp_socket_desktop, dxp_socket
-#include "xcb_util.hpp" // for desktop_info
-#include <atomic>       // for atomic
-#include <mutex>        // for mutex
-#include <vector>       // for vector
-#include <xcb/xcb.h>    // for xcb_connection_t
-#include <xcb/xproto.h> // for xcb_screen_t, xcb_window_t
+#include "composite.hpp"      // for dxp_composite
+#include "desktop.hpp"        // for dxp_desktop
+#include "loop.hpp"           // for dxp_loop
+#include "scheduler.hpp"      // for dxp_scheduler
+#include "socket.hpp"         // for dxp_snapshots, dxp_socket, dxp_refresh
+#include "xcb_util.hpp"       // for desktop_info
+#include <atomic>             // for atomic
+#include <chrono>             // for steady_clock
+#include <condition_variable> // for condition_variable_any
+#include <deque>              // for deque
+#include <memory>             // for unique_ptr
+#include <mutex>              // for mutex
+#include <stop_token>         // for stop_token
+#include <vector>             // for vector
+#include <xcb/damage.h>       // for xcb_damage_damage_t
+#include <xcb/xcb.h>          // for xcb_connection_t
+#include <xcb/xproto.h>       // for xcb_screen_t, xcb_window_t
 
 class dxp_daemon
 {
 public:
+  /// Blocks the shutdown signals, so it is constructed first. Threads of
+  /// the pool inherit the signal mask when the desktops start them
+  dxp_loop loop;
   xcb_connection_t *c;  ///< Xserver connection
   xcb_screen_t *screen; ///< X screen
   xcb_window_t root;
   std::vector<desktop_info> desktops_info;
   /// Desktops that correspond to virtual desktops
   std::vector<dxp_desktop> desktops;
-  /// Desktop that will be sent over sockets
-  std::vector<dxp_socket_desktop> socket_desktops;
+  /// Desktops that will be sent over sockets
+  dxp_snapshots socket_desktops;
   std::atomic<bool> running{ true }; ///< Thread status
   dxp_socket server;                 ///< Socket server
-  std::mutex socket_desktops_lock;
+  dxp_refresh refresh; ///< Captures requested by the socket server
+  /// Clients accepted by the event loop, served in order by another thread
+  std::deque<int> clients;
+  std::mutex clients_lock;
+  std::condition_variable_any clients_cv; ///< Notified about new clients
+  xcb_damage_damage_t damage = XCB_NONE; ///< Root damage. None if unsupported
+  uint8_t damage_event = 0; ///< Response type of the damage notify event
+  /// Builds thumbnails from window contents.
+  /// Null unless enabled in the config and supported by the server
+  std::unique_ptr<dxp_composite> composite;
+  xcb_atom_t current_desktop_atom = XCB_NONE; ///< _NET_CURRENT_DESKTOP
+  uint current = 0;                           ///< Id of the current desktop
+  xcb_atom_t number_of_desktops_atom = XCB_NONE; ///< _NET_NUMBER_OF_DESKTOPS
+  xcb_atom_t desktop_viewport_atom = XCB_NONE;   ///< _NET_DESKTOP_VIEWPORT
+  uint8_t randr_event = 0; ///< First RandR event. 0 if unsupported
+  /// Desktops or monitors were added, removed or moved since the desktops
+  /// were last read
+  bool topology_changed = false;
+  /// Desktops shown on the monitors, at most one per monitor.
+  /// Monitors with several desktops are unknown until one of them is current
+  std::vector<uint> visible;
+  uint8_t screensaver_event = 0; ///< Screen saver notify. 0 if unsupported
+  uint8_t input_opcode = 0;      ///< XInput major opcode. 0 if unsupported
+  bool idle = false; ///< Captures are suspended until the next input
+  /// Time of the next capture of the visible desktops
+  std::chrono::steady_clock::time_point next_capture;
+  /// Time of the capture after the input stops. Moved by every input event
+  std::chrono::steady_clock::time_point input_capture
+      = std::chrono::steady_clock::time_point::max ();
+  /// Time when the listening socket is watched again after accepting
+  /// failed. Max while it is watched
+  std::chrono::steady_clock::time_point accept_retry
+      = std::chrono::steady_clock::time_point::max ();
+  dxp_scheduler scheduler; ///< Adjusts refresh period to the CPU budget
 
   dxp_daemon ();
   void run ();
+
+  /**
+   * Subscribe to changes of the root window with DAMAGE extension.
+   * If extension is missing, desktops will be probed for changes instead.
+   */
+  void init_damage ();
+
+  /**
+   * Redirect top level windows if composite capture is enabled
+   */
+  void init_composite ();
+
+  /**
+   * Subscribe to screen saver activation and raw input events to suspend
+   * captures while the user is away
+   */
+  void init_idle ();
+
+  /**
+   * Check if the screen saver is active or no input came for
+   * dxp_idle_timeout
+   */
+  bool is_idle ();
+
+  /**
+   * Resume suspended captures and postpone the capture after the input
+   */
+  void handle_input ();
+
+  /**
+   * Mark desktops that are the only ones on their monitor as visible
+   */
+  void init_visible ();
+
+  /**
+   * Subscribe to changes of the number of desktops, their viewports and
+   * monitor configuration
+   */
+  void init_topology ();
+
+  /**
+   * Read desktops again and replace the ones that were added, removed or
+   * resized. Thumbnails of the other desktops are kept
+   */
+  void update_topology ();
+
+  /**
+   * Stop capturing desktops that don't fit on a monitor anymore
+   */
+  void hide_unplugged ();
+
+  /**
+   * Update the current desktop and schedule its capture
+   */
+  void set_current_desktop (uint id);
+
+  /**
+   * React to desktop switches and damage of the root window
+   */
+  void handle_event (xcb_generic_event_t *event);
+
+  /**
+   * Handle events of the loop until it's time to capture visible desktops,
+   * a client requested a fresh capture or the daemon is stopped
+   */
+  void wait_for_capture ();
+
+  /**
+   * Queue pending connections for the thread that serves clients.
+   *
+   * If accepting fails, the listening socket is taken out of the loop for
+   * a while.
+   */
+  void accept_clients ();
+
+  /**
+   * Serve clients accepted by the event loop until stopped
+   */
+  void serve_clients (const std::stop_token &stop);
+
+  /**
+   * Recapture damaged parts of visible desktops, share the result and
+   * schedule the next capture
+   */
+  void capture ();
+
+  /**
+   * Copy of the pixmaps of the desktop for the socket server
+   */
+  dxp_socket_desktop share_desktop (uint id) const;
+
+  /**
+   * Recapture damaged parts of the desktop.
+   *
+   * Returns false if the pixmap is already up to date.
+   */
+  bool update_desktop (uint id);
 };
 
 #endif /* ifndef DXP_DAEMON_HPP */
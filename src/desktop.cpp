@@ -1,45 +1,349 @@
 #include "desktop.hpp"
-#include "config.hpp"   // for dxp_height, dxp_width
+#include "config.hpp"   // for dxp_height, dxp_width, resize_filter
+#include "pool.hpp"     // for dxp_pool
+#include "tune.hpp"     // for dxp_tuning
 #include "xcb_util.hpp" // for check, xcb_unique_ptr
-#include <cmath>        // for floor
-#include <memory>       // for unique_ptr
+#include <algorithm>    // for max, min
+#include <array>        // for array
+#include <climits>      // for INT_MAX, UINT_MAX
+#include <cmath>        // for sqrt
+#include <cstddef>      // for size_t
+#include <iostream>     // for operator<<, endl, basic_ostream, cerr
+#include <memory>       // for unique_ptr, make_unique
+#include <stdexcept>    // for runtime_error
 #include <string>       // for allocator
+#include <utility>      // for move
 #include <xcb/xcb.h>    // for xcb_generic_error_t
 #include <xcb/xproto.h> // for xcb_get_image, xcb_get_image_data, xcb_get_i...
 
 constexpr bool dxp_horizontal_stacking = (dxp_width == 0);
 constexpr bool dxp_vertical_stacking = (dxp_height == 0);
 
+///
+/// Bitshifts are used to preserve precision in nearest neighbour ratios.
+/// Straight up dividing source_width by target_width will lose some data.
+/// Bitshifting this value left increases precision after the division.
+/// And when the real ratio needs to be used it can be bitshifted right.
+///
+/// k_precision_bits is the number of bits to reserve for precision.
+/// Can be way lower than 16.
+///
+constexpr int k_precision_bits = 16;
+
+/// Damaged areas will be merged into one if there are more of them
+constexpr std::size_t k_max_damage_rects = 8;
+
+/// 64 bit FNV-1a parameters, used to hash probed pixels
+constexpr uint64_t k_fnv_offset = 14695981039346656037ULL;
+constexpr uint64_t k_fnv_prime = 1099511628211ULL;
+
+/**
+ * Conversion of pixels between the root visual format and bgra8888
+ */
+template <pixel_format F> struct pixel_traits;
+
+template <> struct pixel_traits<pixel_format::bgra8888>
+{
+  using type = uint32_t;
+
+  static uint32_t
+  load (uint32_t p)
+  {
+    return p;
+  }
+
+  static uint32_t
+  store (uint32_t p)
+  {
+    return p;
+  }
+};
+
+template <> struct pixel_traits<pixel_format::rgb565>
+{
+  using type = uint16_t;
+
+  static uint32_t
+  load (uint16_t p)
+  {
+    // High bits are repeated in the low ones, so white stays white
+    const uint32_t r = (p >> 11) & 0x1F;
+    const uint32_t g = (p >> 5) & 0x3F;
+    const uint32_t b = p & 0x1F;
+    return (r << 3 | r >> 2) << 16 | (g << 2 | g >> 4) << 8 | (b << 3 | b >> 2);
+  }
+
+  static uint16_t
+  store (uint32_t p)
+  {
+    return uint16_t (((p >> 8) & 0xF800) | ((p >> 5) & 0x07E0)
+                     | ((p >> 3) & 0x001F));
+  }
+};
+
+template <> struct pixel_traits<pixel_format::rgb101010>
+{
+  using type = uint32_t;
+
+  static uint32_t
+  load (uint32_t p)
+  {
+    return ((p >> 6) & 0xFF0000) | ((p >> 4) & 0xFF00) | ((p >> 2) & 0xFF);
+  }
+
+  static uint32_t
+  store (uint32_t p)
+  {
+    const uint32_t r = (p >> 16) & 0xFF;
+    const uint32_t g = (p >> 8) & 0xFF;
+    const uint32_t b = p & 0xFF;
+    return (r << 2 | r >> 6) << 20 | (g << 2 | g >> 6) << 10
+           | (b << 2 | b >> 6);
+  }
+};
+
+/**
+ * Convert image from the format F to bgra8888.
+ *
+ * Rows of the input start stride bytes apart. Loops have no branches, so
+ * the compiler vectorizes them.
+ */
+template <pixel_format F>
+void
+load_image (const uint8_t *__restrict input, uint32_t *__restrict output,
+            int width, int height, int stride)
+{
+  using type = typename pixel_traits<F>::type;
+
+  for (int y = 0; y < height; y++)
+    {
+      const auto *line = reinterpret_cast<const type *> (input + y * stride);
+      for (int x = 0; x < width; x++)
+        {
+          output[y * width + x] = pixel_traits<F>::load (line[x]);
+        }
+    }
+}
+
+/**
+ * Convert a row of bgra8888 pixels to the format F
+ */
+template <pixel_format F>
+void
+store_row (const uint32_t *__restrict input, uint8_t *__restrict output,
+           int width)
+{
+  using type = typename pixel_traits<F>::type;
+  auto *line = reinterpret_cast<type *> (output);
+
+  for (int x = 0; x < width; x++)
+    {
+      line[x] = pixel_traits<F>::store (input[x]);
+    }
+}
+
+/**
+ * Convert image from the format to bgra8888
+ */
+static void
+load_image (pixel_format format, const uint8_t *input, uint32_t *output,
+            int width, int height, int stride)
+{
+  switch (format)
+    {
+    case pixel_format::bgra8888:
+      load_image<pixel_format::bgra8888> (input, output, width, height,
+                                          stride);
+      break;
+    case pixel_format::rgb565:
+      load_image<pixel_format::rgb565> (input, output, width, height, stride);
+      break;
+    case pixel_format::rgb101010:
+      load_image<pixel_format::rgb101010> (input, output, width, height,
+                                           stride);
+      break;
+    }
+}
+
+/**
+ * Convert a row of bgra8888 pixels to the format
+ */
+static void
+store_row (pixel_format format, const uint32_t *input, uint8_t *output,
+           int width)
+{
+  switch (format)
+    {
+    case pixel_format::bgra8888:
+      store_row<pixel_format::bgra8888> (input, output, width);
+      break;
+    case pixel_format::rgb565:
+      store_row<pixel_format::rgb565> (input, output, width);
+      break;
+    case pixel_format::rgb101010:
+      store_row<pixel_format::rgb101010> (input, output, width);
+      break;
+    }
+}
+
+/**
+ * Source column sampled by nn_resize for the target column x
+ */
+inline int
+nn_source_x (int x, int x_ratio)
+{
+  return ((x + 1) * x_ratio) >> k_precision_bits;
+}
+
+/**
+ * Source row sampled by nn_resize for the target row y
+ */
+inline int
+nn_source_y (int y, int y_ratio)
+{
+  return (y * y_ratio) >> k_precision_bits;
+}
+
+/**
+ * Size of the pixmap of a desktop with the given size: width, height
+ */
+std::array<uint, 2>
+dxp_desktop::thumbnail_size (uint width, uint height)
+{
+  const float screen_ratio = float (width) / float (height); ///< width/height
+
+  if (dxp_horizontal_stacking)
+    {
+      return { uint (float (dxp_height) * screen_ratio), dxp_height };
+    }
+  return { dxp_width, uint (float (dxp_width) / screen_ratio) };
+}
+
 dxp_desktop::dxp_desktop (
     const int16_t x,  ///< x coordinate of the top left corner
     const int16_t y,  ///< y coordinate of the top left corner
     const uint width, ///< width of display
     const uint height ///< height of display
     )
-    : drawable (x, y, width, height)
+    : drawable (x, y, width, height), pool (&dxp_pool::shared ())
+{
+  this->format = find_pixel_format (drawable::screen);
+  init_pixmaps (dxp_tuning::current ());
+
+  // Screenshots will be written directly into shared memory if possible.
+  // Only a single band is stored at a time
+  try
+    {
+      this->shm = std::make_unique<dxp_shm> (
+          drawable::c, this->width * this->band_height * 4U);
+    }
+  catch (const shm_error &e)
+    {
+      std::cerr << e.what () << ". Falling back to xcb_get_image"
+                << std::endl;
+    }
+
+  if (dxp_render_downscale)
+    {
+      try
+        {
+          this->render = std::make_unique<dxp_render> (
+              drawable::c, drawable::screen, this->x, this->y, this->width,
+              this->height, this->pixmap_width, this->pixmap_height);
+        }
+      catch (const std::runtime_error &e)
+        {
+          std::cerr << e.what () << ". Falling back to client side downscale"
+                    << std::endl;
+        }
+    }
+}
+
+/**
+ * Desktop of the given size that processes bgra8888 frames put into
+ * image_ptr instead of capturing them. Used by the tuner to measure the
+ * settings on the pool.
+ *
+ * Nothing is captured, so shared memory and RENDER aren't set up.
+ */
+dxp_desktop::dxp_desktop (uint width, uint height, const dxp_tuning &tuning,
+                          dxp_pool &pool)
+    : drawable (0, 0, width, height), pool (&pool)
+{
+  this->format = pixel_format::bgra8888;
+  init_pixmaps (tuning);
+}
+
+/**
+ * Set up the pixmaps and filters for this->format and the settings
+ */
+void
+dxp_desktop::init_pixmaps (const dxp_tuning &tuning)
 {
   // Initializing non built-in types to zeros
   this->image_ptr = nullptr;
 
+  // Nothing was captured yet
+  damage_all ();
+
   // Check if both are set or unset simultaneously
   static_assert ((dxp_height == 0) != (dxp_width == 0),
                  "Height and width can't be set or unset simultaneously");
 
-  float screen_ratio = float (this->width) / this->height; ///< width/height
+  const auto size = thumbnail_size (this->width, this->height);
+  this->pixmap_width = size[0];
+  this->pixmap_height = size[1];
 
-  if (dxp_horizontal_stacking)
+  this->bytes_per_pixel = this->format == pixel_format::rgb565 ? 2 : 4;
+
+  // Create a small pixmap with the size of downscaled screenshot from config
+  this->pixmap_stride = (this->pixmap_width * this->bytes_per_pixel + 3) & ~3U;
+  this->pixmap.resize (this->pixmap_stride * this->pixmap_height);
+
+  // Levels stop before a side gets shorter than a pixel
+  uint mip_width = this->pixmap_width;
+  uint mip_height = this->pixmap_height;
+  for (uint i = 1; i < dxp_pixmap_levels && mip_width >= 2 && mip_height >= 2;
+       i++)
     {
-      this->pixmap_height = dxp_height;
-      this->pixmap_width = this->pixmap_height * screen_ratio;
+      mip_width /= 2;
+      mip_height /= 2;
+
+      dxp_mip mip{ mip_width, mip_height,
+                   (mip_width * this->bytes_per_pixel + 3) & ~3U, {} };
+      mip.pixmap.resize (mip.stride * mip.height);
+      this->mips.push_back (std::move (mip));
     }
-  else if (dxp_vertical_stacking)
+
+  // To remove aliasing in the resulting image,
+  // a low pass filter should be used on the source.
+  this->radius = this->width / this->pixmap_width / 2;
+
+  this->x_ratio
+      = (int (this->width) << k_precision_bits) / int (this->pixmap_width);
+  this->y_ratio
+      = (int (this->height) << k_precision_bits) / int (this->pixmap_height);
+
+  this->tile_bytes = tuning.tile_bytes;
+  if (tuning.filter != resize_filter::blur)
     {
-      this->pixmap_width = dxp_width;
-      this->pixmap_height = this->pixmap_width / screen_ratio;
+      this->resampler = std::make_unique<dxp_resampler> (
+          tuning.filter, this->width, this->height, this->pixmap_width,
+          this->pixmap_height);
     }
 
-  // Create a small pixmap with the size of downscaled screenshot from config
-  this->pixmap.resize (this->pixmap_width * this->pixmap_height * 4U);
+  // Each band has to fit the source rows of at least one pixmap row
+  uint footprint = 0;
+  for (int y = 0; y < int (this->pixmap_height); y++)
+    {
+      footprint
+          = std::max (footprint, uint (source_bottom (y) - source_top (y)));
+    }
+  this->band_height
+      = dxp_capture_band_height == 0
+            ? this->height
+            : std::min (std::max (dxp_capture_band_height, footprint),
+                        this->height);
 }
 
 /**
@@ -48,280 +352,731 @@ dxp_desktop::dxp_desktop (
 void
 dxp_desktop::save_screen ()
 {
-  // Request the screenshot of the virtual desktop
-  auto gi_cookie = xcb_get_image (
-      drawable::c,               /* Connection */
-      XCB_IMAGE_FORMAT_Z_PIXMAP, /* Z_Pixmap is 100 faster than XY_PIXMAP */
-      drawable::screen->root,    /* Screenshot relative to root */
-      this->x, this->y,          /* X, Y offset */
-      this->width, this->height, /* Dimensions */
-      uint32_t (~0)              /* Plane mask (all bits to get all planes) */
-  );
+  if (!save_render ())
+    {
+      xcb_rectangle_t area{ 0, 0, uint16_t (this->width),
+                            uint16_t (this->height) };
+      uint bands = UINT_MAX;
+      save_region (area, bands);
+    }
+  this->damage.clear ();
+  this->last_capture = std::chrono::steady_clock::now ();
+}
 
-  // Not freeing gi_reply causes memory leak, as xcb_get_image always
-  // allocates new space for the image
-  xcb_generic_error_t *e = nullptr;
-  auto gi_reply = xcb_unique_ptr<xcb_get_image_reply_t> (
-      xcb_get_image_reply (drawable::c, gi_cookie, &e));
-  check (e, "XCB error while getting image reply");
+/**
+ * Downscale the desktop on the X server if RENDER downscaling is enabled.
+ *
+ * Returns false if the pixmap has to be updated on the client side.
+ */
+bool
+dxp_desktop::save_render ()
+{
+  if (!this->render)
+    {
+      return false;
+    }
+
+  try
+    {
+      this->render->get_image (this->pixmap.data ());
+      return true;
+    }
+  catch (const xcb_error &e)
+    {
+      // Don't retry RENDER, it will most likely fail again
+      std::cerr << e.what () << ". Falling back to client side downscale"
+                << std::endl;
+      this->render.reset ();
+      return false;
+    }
+}
 
-  this->image_ptr = xcb_get_image_data (gi_reply.get ());
+/**
+ * Mark area of the root window as changed.
+ * Parts of the area outside of the desktop are ignored.
+ */
+void
+dxp_desktop::add_damage (xcb_rectangle_t area)
+{
+  // Converting to desktop coordinates and clipping to desktop bounds
+  int x0 = std::max (area.x - this->x, 0);
+  int y0 = std::max (area.y - this->y, 0);
+  int x1 = std::min (area.x + area.width - this->x, int (this->width));
+  int y1 = std::min (area.y + area.height - this->y, int (this->height));
 
-  // To remove aliasing in the resulting image,
-  // a low pass filter should be used on the source.
-  int radius = this->width / this->pixmap_width / 2;
+  if (x0 >= x1 || y0 >= y1) // Area is outside of the desktop
+    {
+      return;
+    }
 
-  box_blur_horizontal (this->image_ptr, this->width, this->height, radius);
-  box_blur_vertical (this->image_ptr, this->width, this->height, radius);
+  // Merge overlapping rectangles so the same pixels aren't captured twice.
+  // Merged rectangle may overlap others, so checking until nothing changes
+  bool merged = true;
+  while (merged)
+    {
+      merged = false;
+      for (auto d = this->damage.begin (); d != this->damage.end (); d++)
+        {
+          if (x0 <= d->x + d->width && d->x <= x1 && y0 <= d->y + d->height
+              && d->y <= y1)
+            {
+              x0 = std::min (x0, int (d->x));
+              y0 = std::min (y0, int (d->y));
+              x1 = std::max (x1, d->x + d->width);
+              y1 = std::max (y1, d->y + d->height);
+
+              this->damage.erase (d);
+              merged = true;
+              break;
+            }
+        }
+    }
+
+  this->damage.push_back (xcb_rectangle_t{ int16_t (x0), int16_t (y0),
+                                           uint16_t (x1 - x0),
+                                           uint16_t (y1 - y0) });
 
-  nn_resize (this->image_ptr, this->pixmap.data (), this->width, this->height,
-             this->pixmap_width, this->pixmap_height);
+  // Lots of small captures are slower than a single big one
+  if (this->damage.size () > k_max_damage_rects)
+    {
+      for (const auto &d : this->damage)
+        {
+          x0 = std::min (x0, int (d.x));
+          y0 = std::min (y0, int (d.y));
+          x1 = std::max (x1, d.x + d.width);
+          y1 = std::max (y1, d.y + d.height);
+        }
+      this->damage = { xcb_rectangle_t{ int16_t (x0), int16_t (y0),
+                                        uint16_t (x1 - x0),
+                                        uint16_t (y1 - y0) } };
+    }
 }
 
 /**
- * Apply a horizontal box filter (low pass) to the image.
+ * Mark the whole desktop as changed
+ */
+void
+dxp_desktop::damage_all ()
+{
+  this->damage = { xcb_rectangle_t{ 0, 0, uint16_t (this->width),
+                                    uint16_t (this->height) } };
+}
+
+/**
+ * Recapture damaged areas and update matching parts of the pixmap.
  *
- * Uses algorithm described here
- * http://blog.ivank.net/fastest-gaussian-blur.html
- * and here https://www.gamasutra.com/view/feature/3102
+ * At most dxp_bands_per_capture bands are captured. Areas that didn't fit
+ * are left damaged.
  */
 void
-box_blur_horizontal (uint8_t *image, int width, int height, uint radius)
+dxp_desktop::save_damage ()
 {
-  auto *input32 = reinterpret_cast<uint32_t *> (image);
-  class pixmap img (input32, width); // Adds operator[][]
+  // Downscaling on the server is cheap enough to always redo it fully
+  if (save_render ())
+    {
+      this->damage.clear ();
+      this->last_capture = std::chrono::steady_clock::now ();
+      return;
+    }
 
-  constexpr uint32_t a_mask = 0xFF000000;
-  constexpr uint32_t r_mask = 0x00FF0000;
-  constexpr uint32_t g_mask = 0x0000FF00;
-  constexpr uint32_t b_mask = 0x000000FF;
+  uint bands = dxp_bands_per_capture == 0 ? UINT_MAX : dxp_bands_per_capture;
 
-  int n = radius * 2 + 1; ///< Amount of pixels in a kernel
+  std::vector<xcb_rectangle_t> remaining;
+  for (auto area : this->damage)
+    {
+      if (!save_region (area, bands))
+        {
+          remaining.push_back (area);
+        }
+    }
+  this->damage = remaining;
 
-  for (int y = 0; y < height; y++)
+  if (this->damage.empty ())
     {
-      // Accumulators for color values
-      uint32_t r = 0;
-      uint32_t g = 0;
-      uint32_t b = 0;
+      this->last_capture = std::chrono::steady_clock::now ();
+    }
+}
 
-      /// Leftmost part of the kernel.
-      /// As changes to the image are made in place,
-      /// unchanged kernel values must be stored
-      std::vector<uint32_t> left_pixels{};
-      left_pixels.reserve (radius + 2);
+/**
+ * Check if the desktop changed since the previous probe.
+ *
+ * Pixels of dxp_probe_grid x dxp_probe_grid small squares spread over the
+ * desktop are hashed and compared to the previous hash. All requests are
+ * sent before waiting for replies, so the probe costs a single round trip.
+ */
+bool
+dxp_desktop::probe ()
+{
+  const uint size = std::min ({ dxp_probe_size, this->width, this->height });
 
-      // Fill accumulators. Image gets mirrored for edge pixels
-      for (int x = radius; x > 0; x--)
+  std::vector<xcb_get_image_cookie_t> cookies;
+  cookies.reserve (dxp_probe_grid * dxp_probe_grid);
+  for (uint row = 0; row < dxp_probe_grid; row++)
+    {
+      // Squares are centered in the cells of the grid
+      const uint y
+          = std::min ((2 * row + 1) * this->height / dxp_probe_grid / 2,
+                      this->height - size);
+      for (uint col = 0; col < dxp_probe_grid; col++)
         {
-          r += 2 * (img[x][y] & r_mask);
-          g += 2 * (img[x][y] & g_mask);
-          b += 2 * (img[x][y] & b_mask);
-
-          left_pixels.insert (left_pixels.cbegin (), img[x][y]);
+          const uint x
+              = std::min ((2 * col + 1) * this->width / dxp_probe_grid / 2,
+                          this->width - size);
+          cookies.push_back (xcb_get_image (
+              drawable::c, XCB_IMAGE_FORMAT_Z_PIXMAP, drawable::screen->root,
+              int16_t (this->x + int (x)), int16_t (this->y + int (y)), size,
+              size, uint32_t (~0)));
         }
+    }
 
-      // Add the first pixel to the accumulators
-      r += img[0][y] & r_mask;
-      g += img[0][y] & g_mask;
-      b += img[0][y] & b_mask;
+  uint64_t hash = k_fnv_offset;
+  for (auto cookie : cookies)
+    {
+      xcb_generic_error_t *e = nullptr;
+      auto reply = xcb_unique_ptr<xcb_get_image_reply_t> (
+          xcb_get_image_reply (drawable::c, cookie, &e));
+      check (e, "XCB error while getting probe image reply");
 
-      // Main loop.
-      // Set pixel to the accumulated value and increment accumulator
-      for (int x = 0; x < width - radius - 1; x++)
+      const auto *data = xcb_get_image_data (reply.get ());
+      const int len = xcb_get_image_data_length (reply.get ());
+      for (int i = 0; i < len; i++)
         {
-          left_pixels.push_back (img[x][y]);
-          img[x][y] = (r / n) & r_mask | (g / n) & g_mask | (b / n) & b_mask;
-
-          // Subtract leftmost
-          r -= left_pixels[0] & r_mask;
-          g -= left_pixels[0] & g_mask;
-          b -= left_pixels[0] & b_mask;
+          hash = (hash ^ data[i]) * k_fnv_prime;
+        }
+    }
 
-          // Add rightmost
-          r += img[x + radius + 1][y] & r_mask;
-          g += img[x + radius + 1][y] & g_mask;
-          b += img[x + radius + 1][y] & b_mask;
+  const bool changed = hash != this->probe_hash;
+  this->probe_hash = hash;
+  return changed;
+}
 
-          left_pixels.erase (left_pixels.cbegin ());
-        }
+/**
+ * Recapture area of the desktop and update matching part of the pixmap.
+ *
+ * Every pixmap pixel is computed from a few source pixels around it, so
+ * only pixels whose sources intersect the area have to be updated. Only the
+ * part of the screen needed to compute them is captured and processed. As
+ * all of the sources are captured, result is identical to processing the
+ * whole screenshot.
+ *
+ * Area is captured in horizontal bands of dxp_capture_band_height. If the
+ * bands run out, area is shrunk to the part that wasn't updated and false
+ * is returned.
+ */
+bool
+dxp_desktop::save_region (xcb_rectangle_t &area, uint &bands)
+{
+  const int area_bottom = area.y + area.height;
 
-      // Mirror image for edge pixels
-      for (int i = 1, x = width - radius - 1; x < width; x++)
-        {
-          left_pixels.push_back (img[x][y]);
-          img[x][y] = (r / n) & r_mask | (g / n) & g_mask | (b / n) & b_mask;
+  // Pixmap columns and rows affected by the area. Sources are monotonic
+  int tx0 = 0;
+  while (tx0 < int (this->pixmap_width) && source_right (tx0) <= area.x)
+    {
+      tx0++;
+    }
+  int tx1 = tx0;
+  while (tx1 < int (this->pixmap_width)
+         && source_left (tx1) < area.x + area.width)
+    {
+      tx1++;
+    }
+  int ty0 = 0;
+  while (ty0 < int (this->pixmap_height) && source_bottom (ty0) <= area.y)
+    {
+      ty0++;
+    }
+  int ty1 = ty0;
+  while (ty1 < int (this->pixmap_height) && source_top (ty1) < area_bottom)
+    {
+      ty1++;
+    }
 
-          r -= left_pixels[0] & r_mask;
-          g -= left_pixels[0] & g_mask;
-          b -= left_pixels[0] & b_mask;
+  if (tx0 == tx1) // Change is not visible on the pixmap
+    {
+      return true;
+    }
 
-          r += img[width - i][y] & r_mask;
-          g += img[width - i][y] & g_mask;
-          b += img[width - i][y] & b_mask;
-          i++;
+  for (int y = ty0; y < ty1;)
+    {
+      if (bands == 0)
+        {
+          // Rows with sources below the new top edge are still affected
+          auto top = std::min (source_bottom (y) - 1, area_bottom - 1);
+          area.height = area_bottom - top;
+          area.y = int16_t (top);
+          return false;
+        }
 
-          left_pixels.erase (left_pixels.cbegin ());
+      // Adding pixmap rows to the band while their sources fit into it
+      int y_end = y + 1;
+      while (y_end < ty1
+             && source_bottom (y_end) - source_top (y)
+                    <= int (this->band_height))
+        {
+          y_end++;
         }
+
+      save_band (tx0, tx1, y, y_end);
+      bands--;
+      y = y_end;
     }
+
+  return true;
 }
 
 /**
- * Apply a vertical box filter (low pass) to the image.
+ * Capture part of the desktop needed to compute pixmap rows [y0, y1) and
+ * columns [x0, x1) and update them
  */
 void
-box_blur_vertical (uint8_t *image, int width, int height, uint radius)
+dxp_desktop::save_band (int x0, int x1, int y0, int y1)
 {
-  auto *input32 = reinterpret_cast<uint32_t *> (image);
-  class pixmap img (input32, width);
+  // Part of the screen covered by the sources of the affected pixels
+  const int left = source_left (x0);
+  const int top = source_top (y0);
+  const int right = source_right (x1 - 1);
+  const int bottom = source_bottom (y1 - 1);
 
-  constexpr uint32_t r_mask = 0x00FF0000;
-  constexpr uint32_t g_mask = 0x0000FF00;
-  constexpr uint32_t b_mask = 0x000000FF;
+  // Holds the screenshot if it was sent over the socket.
+  // Should outlive this->image_ptr usage
+  auto gi_reply = xcb_unique_ptr<xcb_get_image_reply_t> (nullptr);
 
-  int n = radius * 2 + 1;
+  this->image_ptr
+      = capture ({ int16_t (left), int16_t (top), uint16_t (right - left),
+                   uint16_t (bottom - top) },
+                 gi_reply);
 
-  for (int x = 0; x < width; x++)
+  // Rows of X images are padded to 32 bits
+  const int stride = ((right - left) * int (this->bytes_per_pixel) + 3) & ~3;
+
+  save_sources (x0, x1, y0, y1, left, top, stride);
+}
+
+/**
+ * Update pixmap rows [y0, y1) and columns [x0, x1) from their sources.
+ *
+ * Image holds source columns starting at left and source rows starting at
+ * top. Its rows are stride bytes long.
+ */
+void
+dxp_desktop::save_sources (int x0, int x1, int y0, int y1, int left, int top,
+                           int stride)
+{
+  if (!this->resampler)
     {
-      uint32_t r = 0;
-      uint32_t g = 0;
-      uint32_t b = 0;
+      save_tiles (x0, x1, y0, y1, left, top, stride);
+      return;
+    }
 
-      std::vector<uint32_t> top_pixels{};
-      top_pixels.reserve (radius + 2);
+  const int right = source_right (x1 - 1);
+  const int bottom = source_bottom (y1 - 1);
 
-      for (int y = radius; y > 0; y--)
-        {
-          r += 2 * (img[x][y] & r_mask);
-          g += 2 * (img[x][y] & g_mask);
-          b += 2 * (img[x][y] & b_mask);
+  // Native format is read directly, others are converted first
+  dxp_image_view<const uint32_t> image (
+      reinterpret_cast<uint32_t *> (this->image_ptr), right - left,
+      bottom - top, stride / 4);
+  if (this->format != pixel_format::bgra8888)
+    {
+      this->buffer.resize (size_t (right - left) * size_t (bottom - top));
+      load_image (this->format, this->image_ptr, this->buffer.data (),
+                  right - left, bottom - top, stride);
+      image = { this->buffer.data (), right - left, bottom - top };
+    }
 
-          top_pixels.insert (top_pixels.cbegin (), img[x][y]);
-        }
+  // Rows are independent, each thread computes a contiguous block of them
+  auto &pool = *this->pool;
+  const int blocks = std::min (int (pool.size ()), y1 - y0);
+  pool.run (blocks, [&] (int i) {
+    std::vector<uint32_t> row (size_t (x1 - x0));
+    for (int y = y0 + (y1 - y0) * i / blocks;
+         y < y0 + (y1 - y0) * (i + 1) / blocks; y++)
+      {
+        this->resampler->resample_row (image, left, top, y, x0, x1,
+                                       row.data ());
+
+        store_row (this->format, row.data (),
+                   this->pixmap.data () + size_t (y) * this->pixmap_stride
+                       + size_t (x0) * this->bytes_per_pixel,
+                   x1 - x0);
+      }
+  });
+}
+
+/**
+ * Average the pixmap into the smaller levels.
+ *
+ * Pairs of rows of the previous level are converted to bgra8888, averaged
+ * in 2x2 blocks and converted back. Odd last row and column are dropped.
+ */
+void
+dxp_desktop::save_mips ()
+{
+  const uint8_t *source = this->pixmap.data ();
+  uint source_width = this->pixmap_width;
+  uint source_stride = this->pixmap_stride;
 
-      r += img[x][0] & r_mask;
-      g += img[x][0] & g_mask;
-      b += img[x][0] & b_mask;
+  std::vector<uint32_t> rows;
+  std::vector<uint32_t> row;
+  for (auto &mip : this->mips)
+    {
+      rows.resize (size_t (source_width) * 2);
+      row.resize (mip.width);
 
-      for (int y = 0; y < height - radius - 1; y++)
+      for (uint y = 0; y < mip.height; y++)
         {
-          top_pixels.push_back (img[x][y]);
-          img[x][y] = (r / n) & r_mask | (g / n) & g_mask | (b / n) & b_mask;
+          load_image (this->format, source + 2 * y * source_stride,
+                      rows.data (), int (source_width), 2,
+                      int (source_stride));
+          halve_rows (rows.data (), rows.data () + source_width, row.data (),
+                      int (mip.width));
+          store_row (this->format, row.data (),
+                     mip.pixmap.data () + y * mip.stride, int (mip.width));
+        }
 
-          r -= top_pixels[0] & r_mask;
-          g -= top_pixels[0] & g_mask;
-          b -= top_pixels[0] & b_mask;
+      source = mip.pixmap.data ();
+      source_width = mip.width;
+      source_stride = mip.stride;
+    }
+}
 
-          r += img[x][y + radius + 1] & r_mask;
-          g += img[x][y + radius + 1] & g_mask;
-          b += img[x][y + radius + 1] & b_mask;
+/**
+ * Blur and sample captured band in tiles of about the tuned tile bytes.
+ *
+ * Tiles are square in source pixels, but each of them has to hold the blur
+ * kernels of at least one pixmap pixel. Tiles are independent, so they are
+ * processed by the threads of the pool. Without a tile size the band is
+ * split into a column block per thread.
+ */
+void
+dxp_desktop::save_tiles (int x0, int x1, int y0, int y1, int left, int top,
+                         int stride)
+{
+  auto &pool = *this->pool;
+  const uint tile_bytes = this->tile_bytes;
+  const int side = tile_bytes == 0 ? INT_MAX
+                                   : int (std::sqrt (double (tile_bytes) / 4));
 
-          top_pixels.erase (top_pixels.cbegin ());
-        }
-      for (int i = 1, y = height - radius - 1; y < height; y++)
+  // Pixmap columns and rows of each tile: x0, x1, y0, y1
+  std::vector<std::array<int, 4>> tiles;
+
+  for (int ty0 = y0; ty0 < y1;)
+    {
+      int ty1 = ty0 + 1;
+      while (ty1 < y1 && source_bottom (ty1) - source_top (ty0) <= side)
         {
-          top_pixels.push_back (img[x][y]);
-          img[x][y] = (r / n) & r_mask | (g / n) & g_mask | (b / n) & b_mask;
+          ty1++;
+        }
 
-          r -= top_pixels[0] & r_mask;
-          g -= top_pixels[0] & g_mask;
-          b -= top_pixels[0] & b_mask;
+      // Short tiles are made wider to use the whole space
+      const int tile_height = source_bottom (ty1 - 1) - source_top (ty0);
+      const int tile_width
+          = tile_bytes == 0
+                ? (source_right (x1 - 1) - source_left (x0) - 1)
+                          / int (pool.size ())
+                      + 1
+                : int (tile_bytes / 4 / uint (tile_height));
 
-          r += img[x][height - i] & r_mask;
-          g += img[x][height - i] & g_mask;
-          b += img[x][height - i] & b_mask;
-          i++;
+      for (int tx0 = x0; tx0 < x1;)
+        {
+          int tx1 = tx0 + 1;
+          while (tx1 < x1
+                 && source_right (tx1) - source_left (tx0) <= tile_width)
+            {
+              tx1++;
+            }
 
-          top_pixels.erase (top_pixels.cbegin ());
+          tiles.push_back ({ tx0, tx1, ty0, ty1 });
+          tx0 = tx1;
         }
+
+      ty0 = ty1;
     }
+
+  pool.run (int (tiles.size ()), [&] (int i) {
+    const auto &[tx0, tx1, ty0, ty1] = tiles[size_t (i)];
+    save_tile (tx0, tx1, ty0, ty1, left, top, stride);
+  });
 }
 
 /**
- * Nearest neighbor resize. Very fast
- * https://stackoverflow.com/questions/28566290
+ * Blur the sources of pixmap rows [y0, y1) and columns [x0, x1) and sample
+ * them.
+ *
+ * Sources are copied from the captured band into a buffer of the calling
+ * thread and converted to bgra8888 on the way. Both blur passes and
+ * sampling then work on the copy, which stays in the cache. Sampled pixels
+ * are at least radius away from the edges of the copy that aren't edges of
+ * the desktop, so they are identical to the ones of a blurred whole
+ * screenshot.
  */
 void
-dxp_desktop::nn_resize (const uint8_t *__restrict input,
-                        uint8_t *__restrict output,
-                        int source_width, /* Source dimensions */
-                        int source_height,
-                        int target_width, /* Target dimensions */
-                        int target_height)
-{
-  const auto *input32 = reinterpret_cast<const uint32_t *> (input);
-  auto *output32 = reinterpret_cast<uint32_t *> (output);
-
-  //
-  // Bitshifts are used to preserve precision in x_ratio and y_ratio.
-  // Straight up dividing source_width by target_width will lose some data.
-  // Bitshifting this value left increases precision after the division.
-  // And when the real x_ratio needs to be used it can be bitshifted right.
-  //
-  // k_precision_bytes is the number of bits to reserve for precision.
-  // Can be way lower than 16.
-  //
-  constexpr int k_precision_bytes = 16;
-
-  const int x_ratio = (source_width << k_precision_bytes) / target_width;
-  const int y_ratio = (source_height << k_precision_bytes) / target_height;
-
-  for (int y = 0; y < target_height; y++)
-    {
-      int y_source = ((y * y_ratio) >> k_precision_bytes) * source_width;
-      int y_dest = y * target_width;
+dxp_desktop::save_tile (int x0, int x1, int y0, int y1, int left, int top,
+                        int stride)
+{
+  const int tile_left = source_left (x0);
+  const int tile_top = source_top (y0);
+  const int width = source_right (x1 - 1) - tile_left;
+  const int height = source_bottom (y1 - 1) - tile_top;
 
-      int x_source = 0;
-      const uint32_t *input32_line = input32 + y_source;
-      for (int x = 0; x < target_width; x++)
+  // Tiles are processed by several threads at once
+  thread_local std::vector<uint32_t> tile;
+  tile.resize (size_t (width) * size_t (height));
+  load_image (this->format,
+              this->image_ptr + (tile_top - top) * stride
+                  + (tile_left - left) * int (this->bytes_per_pixel),
+              tile.data (), width, height, stride);
+
+  const dxp_image_view<uint32_t> image (tile.data (), width, height);
+  box_blur_horizontal (image, this->radius);
+  box_blur_vertical (image, this->radius);
+
+  // Sampling the affected part of the pixmap from the tile
+  std::vector<uint32_t> row (size_t (x1 - x0));
+  for (int y = y0; y < y1; y++)
+    {
+      const uint32_t *input32_line
+          = image.row (source_y (y) - tile_top) - tile_left;
+      for (int x = x0; x < x1; x++)
         {
-          x_source += x_ratio;
-          output32[y_dest + x] = input32_line[x_source >> k_precision_bytes];
+          row[size_t (x - x0)] = input32_line[source_x (x)];
         }
+
+      store_row (this->format, row.data (),
+                 this->pixmap.data () + size_t (y) * this->pixmap_stride
+                     + size_t (x0) * this->bytes_per_pixel,
+                 x1 - x0);
     }
 }
 
 /**
- * Bilinear resize.
- * Additional overhead compared to nearest neighbor resize does not result in
- * significantly better images. So this resize algorithm is not used.
+ * Get pixel format of the root visual.
+ *
+ * Throws runtime_error if the format is not supported.
  */
-void
-dxp_desktop::bilinear_resize (const uint8_t *__restrict input,
-                              uint8_t *__restrict output,
-                              int source_width, /* Source dimensions */
-                              int source_height,
-                              int target_width, /* Target dimensions */
-                              int target_height)
+pixel_format
+dxp_desktop::find_pixel_format (const xcb_screen_t *screen)
+{
+  for (auto depths = xcb_screen_allowed_depths_iterator (screen); depths.rem;
+       xcb_depth_next (&depths))
+    {
+      for (auto visuals = xcb_depth_visuals_iterator (depths.data);
+           visuals.rem; xcb_visualtype_next (&visuals))
+        {
+          if (visuals.data->visual_id != screen->root_visual)
+            {
+              continue;
+            }
+
+          switch (visuals.data->red_mask)
+            {
+            case 0xFF0000:
+              return pixel_format::bgra8888;
+            case 0xF800:
+              return pixel_format::rgb565;
+            case 0x3FF00000:
+              return pixel_format::rgb101010;
+            default:
+              break;
+            }
+        }
+    }
+
+  throw std::runtime_error ("Pixel format of the root visual is not supported");
+}
+
+/**
+ * Source column sampled for the pixmap column x
+ */
+int
+dxp_desktop::source_x (int x) const
+{
+  // Last sample may land right after the end of the line
+  return std::min (nn_source_x (x, this->x_ratio), int (this->width) - 1);
+}
+
+/**
+ * Source row sampled for the pixmap row y
+ */
+int
+dxp_desktop::source_y (int y) const
 {
-  const float x_ratio = float (source_width) / target_width;
-  const float y_ratio = float (source_height) / target_height;
+  return nn_source_y (y, this->y_ratio);
+}
 
-  for (int y_dst = 0; y_dst < target_height; y_dst++)
+/**
+ * First source column needed to compute the pixmap column x
+ */
+int
+dxp_desktop::source_left (int x) const
+{
+  if (this->resampler)
+    {
+      return this->resampler->columns.first[size_t (x)];
+    }
+
+  // Blur of the last columns adds pixels that are already blurred. They
+  // match the ones of the whole screenshot only if the kernel of the first
+  // of them is captured too
+  const int r = int (this->radius);
+  int left = source_x (x) - r;
+  if (source_x (x) + r + 1 >= int (this->width))
     {
-      float y_src = y_dst * y_ratio;
-      int y = std::floor (y_src);
-      float dy = y_src - y;
+      left = std::min (left, int (this->width) - 2 * r - 1);
+    }
+  return std::max (left, 0);
+}
 
-      for (int x_dst = 0; x_dst < target_width; x_dst++)
+/**
+ * Source column after the last one needed to compute the pixmap column x
+ */
+int
+dxp_desktop::source_right (int x) const
+{
+  if (this->resampler)
+    {
+      return this->resampler->columns.first[size_t (x)]
+             + this->resampler->columns.count[size_t (x)];
+    }
+  return std::min (source_x (x) + int (this->radius) + 1, int (this->width));
+}
+
+/**
+ * First source row needed to compute the pixmap row y
+ */
+int
+dxp_desktop::source_top (int y) const
+{
+  if (this->resampler)
+    {
+      return this->resampler->rows.first[size_t (y)];
+    }
+
+  // Same as for the last columns in source_left
+  const int r = int (this->radius);
+  int top = source_y (y) - r;
+  if (source_y (y) + r + 1 >= int (this->height))
+    {
+      top = std::min (top, int (this->height) - 2 * r - 1);
+    }
+  return std::max (top, 0);
+}
+
+/**
+ * Source row after the last one needed to compute the pixmap row y
+ */
+int
+dxp_desktop::source_bottom (int y) const
+{
+  if (this->resampler)
+    {
+      return this->resampler->rows.first[size_t (y)]
+             + this->resampler->rows.count[size_t (y)];
+    }
+  return std::min (source_y (y) + int (this->radius) + 1, int (this->height));
+}
+
+/**
+ * Capture area of the desktop.
+ *
+ * Image is written into shared memory if possible. Otherwise it is sent over
+ * the socket and returned pointer belongs to the reply.
+ */
+uint8_t *
+dxp_desktop::capture (
+    xcb_rectangle_t area,
+    std::unique_ptr<xcb_get_image_reply_t, decltype (&std::free)> &reply)
+{
+  if (this->shm)
+    {
+      try
+        {
+          this->shm->get_image (drawable::screen->root, this->x + area.x,
+                                this->y + area.y, area.width, area.height);
+          return this->shm->data;
+        }
+      catch (const xcb_error &e)
         {
-          float x_src = x_dst * x_ratio;
-          int x = std::floor (x_src);
-          float dx = x_src - x;
+          // Don't retry shared memory, it will most likely fail again
+          std::cerr << e.what () << ". Falling back to xcb_get_image"
+                    << std::endl;
+          this->shm.reset ();
+        }
+    }
 
-          int y_offset = y_dst * target_width;
+  return get_image (area, reply);
+}
 
-          int y0_offset = y * source_width;
-          int y1_offset = y0_offset + source_width;
+/**
+ * Get area of the desktop through the X socket.
+ *
+ * Returned pointer belongs to the reply and is valid until it is freed.
+ */
+uint8_t *
+dxp_desktop::get_image (
+    xcb_rectangle_t area,
+    std::unique_ptr<xcb_get_image_reply_t, decltype (&std::free)> &reply) const
+{
+  // Request the screenshot of the virtual desktop
+  auto gi_cookie = xcb_get_image (
+      drawable::c,               /* Connection */
+      XCB_IMAGE_FORMAT_Z_PIXMAP, /* Z_Pixmap is 100 faster than XY_PIXMAP */
+      drawable::screen->root,    /* Screenshot relative to root */
+      this->x + area.x, this->y + area.y, /* X, Y offset */
+      area.width, area.height,            /* Dimensions */
+      uint32_t (~0) /* Plane mask (all bits to get all planes) */
+  );
 
-          for (int ch = 0; ch < 4; ch++)
-            {
-              output[(x_dst + y_offset) * 4 + ch]
-                  = (input[(x + y0_offset) * 4 + ch] * (1 - dx) * (1 - dy)
-                     + input[(x + y1_offset) * 4 + ch] * (1 - dx) * dy
-                     + input[(x + 1 + y0_offset) * 4 + ch] * dx * (1 - dy)
-                     + input[(x + 1 + y1_offset) * 4 + ch] * dx * dy);
-            }
+  // Not freeing gi_reply causes memory leak, as xcb_get_image always
+  // allocates new space for the image
+  xcb_generic_error_t *e = nullptr;
+  reply = xcb_unique_ptr<xcb_get_image_reply_t> (
+      xcb_get_image_reply (drawable::c, gi_cookie, &e));
+  check (e, "XCB error while getting image reply");
+
+  return xcb_get_image_data (reply.get ());
+}
+
+/**
+ * Nearest neighbor resize. Very fast
+ * https://stackoverflow.com/questions/28566290
+ */
+void
+dxp_desktop::nn_resize (dxp_image_view<const uint32_t> input,
+                        dxp_image_view<uint32_t> output)
+{
+  const int x_ratio = (input.width << k_precision_bits) / output.width;
+  const int y_ratio = (input.height << k_precision_bits) / output.height;
+
+  for (int y = 0; y < output.height; y++)
+    {
+      const uint32_t *__restrict input_row
+          = input.row (nn_source_y (y, y_ratio));
+      uint32_t *__restrict output_row = output.row (y);
+
+      int x_source = 0;
+      for (int x = 0; x < output.width; x++)
+        {
+          x_source += x_ratio;
+          // Last sample may land right after the end of the line
+          output_row[x] = input_row[std::min (x_source >> k_precision_bits,
+                                              input.width - 1)];
         }
     }
 }
+
+/**
+ * Resize with one of the separable filters. Input is not modified, and
+ * filters cover all of the source pixels, so no blur is needed to remove
+ * aliasing
+ */
+void
+dxp_desktop::resample (resize_filter filter,
+                       dxp_image_view<const uint32_t> input,
+                       dxp_image_view<uint32_t> output)
+{
+  dxp_resampler resampler (filter, input.width, input.height, output.width,
+                           output.height);
+  dxp_pool::shared ().run (output.height, [&] (int y) {
+    resampler.resample_row (input, 0, 0, y, 0, output.width, output.row (y));
+  });
+}
@@ -1,48 +1,44 @@
 #ifndef DESKTOP_HPP
 #define DESKTOP_HPP
 
+#include "blur.hpp"     // for box_blur_horizontal, box_blur_vertical
 #include "drawable.hpp" // for drawable
-#include <cstdint>      // for uint8_t, uint32_t, int16_t
+#include "pool.hpp"     // for dxp_pool
+#include "render.hpp"   // for dxp_render
+#include "resample.hpp" // for dxp_resampler
+#include "shm.hpp"      // for dxp_shm
+#include "tune.hpp"     // for dxp_tuning
+#include <array>        // for array
+#include <chrono>       // for steady_clock
+#include <cstdint>      // for uint8_t, uint32_t, uint64_t, int16_t
+#include <cstdlib>      // for free
+#include <memory>       // for unique_ptr
 #include <sys/types.h>  // for uint
 #include <vector>       // for vector
+#include <xcb/xproto.h> // for xcb_get_image_reply_t, xcb_rectangle_t
 
-class pixmap
+/**
+ * Pixel formats of the root visual.
+ *
+ * Captured images are converted to bgra8888 for blurring and resizing and
+ * converted back when stored into the pixmap.
+ */
+enum class pixel_format
 {
-public:
-  uint32_t *data;
-  int width;
-
-  pixmap (uint32_t *img, int width)
-  {
-    this->data = img;
-    this->width = width;
-  }
-
-  class proxy
-  {
-  public:
-    explicit proxy (uint32_t *data, int width)
-    {
-      this->data = data;
-      this->width = width;
-    }
-
-    uint32_t &
-    operator[] (int y)
-    {
-      return data[y * width];
-    }
-
-  private:
-    uint32_t *data;
-    int width;
-  };
-
-  proxy
-  operator[] (int x) const
-  {
-    return proxy (&data[x], width);
-  }
+  bgra8888,  ///< 24 and 32 bit depth, 8 bits per channel
+  rgb565,    ///< 16 bit depth
+  rgb101010, ///< 30 bit depth, 10 bits per channel
+};
+
+/**
+ * Pixmap of a desktop averaged 2:1 from the previous level
+ */
+struct dxp_mip
+{
+  uint width;
+  uint height;
+  uint stride; ///< Bytes in a row, padded to 32 bits
+  std::vector<uint8_t> pixmap;
 };
 
 /**
@@ -55,47 +51,213 @@ public:
   std::vector<uint8_t> pixmap; ///< Constant id for the screenshot's pixmap
   uint pixmap_width;           ///< Width of the pixmap that stores screenshot
   uint pixmap_height;          ///< Height of the pixmap that stores screenshot
+  /// Bytes in a row of the pixmap. Rows are padded to 32 bits like in X images
+  uint pixmap_stride;
+  pixel_format format;  ///< Format of the root visual and the pixmap
+  uint bytes_per_pixel; ///< Size of a pixel in the root visual format
+  /// Captured band converted to bgra8888
+  std::vector<uint32_t> buffer;
+  /// Segment the X server writes screenshots into.
+  /// Null if MIT-SHM is unavailable and images are sent over the socket
+  std::unique_ptr<dxp_shm> shm;
+  /// Downscales screenshots on the X server.
+  /// Null unless enabled in the config and supported by the server
+  std::unique_ptr<dxp_render> render;
+  /// Areas that changed since they were captured. Relative to the desktop
+  std::vector<xcb_rectangle_t> damage;
+  /// Downscales with a separable filter. Null if blur is used instead
+  std::unique_ptr<dxp_resampler> resampler;
+  /// Runs tiles and blocks of rows. Shared pool unless the desktop is
+  /// measured by the tuner
+  dxp_pool *pool;
+  uint tile_bytes;  ///< Size of the tiles of the blur filter
+  uint radius;      ///< Radius of the blur applied before downscaling
+  int x_ratio;      ///< Desktop to pixmap width ratio in fixed point
+  int y_ratio;      ///< Desktop to pixmap height ratio in fixed point
+  uint band_height; ///< Height of the bands the screenshot is captured in
+  uint64_t probe_hash = 0; ///< Hash of pixels sampled by the last probe
+  /// Time when the pixmap was last fully up to date
+  std::chrono::steady_clock::time_point last_capture;
+  /// Smaller pixmaps, each half the size of the previous one. Pixmap itself
+  /// is level 0, mips[0] is level 1
+  std::vector<dxp_mip> mips;
 
   dxp_desktop (int16_t x,    ///< x coordinate of the top left corner
                int16_t y,    ///< y coordinate of the top left corner
                uint width,   ///< Width of the display
                uint height); ///< Height of the display
 
+  /**
+   * Desktop of the given size that processes bgra8888 frames put into
+   * image_ptr instead of capturing them. Used by the tuner to measure the
+   * settings on the pool
+   */
+  dxp_desktop (uint width, uint height, const dxp_tuning &tuning,
+               dxp_pool &pool);
+
+  /**
+   * Size of the pixmap of a desktop with the given size: width, height
+   */
+  static std::array<uint, 2> thumbnail_size (uint width, uint height);
+
   /**
    * Save screenshot, downsize it and set this->image_ptr to point to it
    */
   void save_screen ();
 
   /**
-   * Resize image to specified dimensions with nearest neighbour algorithm
+   * Downscale the desktop on the X server if RENDER downscaling is enabled.
+   *
+   * Returns false if the pixmap has to be updated on the client side.
    */
-  static void
-  nn_resize (const uint8_t *input, ///< Input RGBA 1D array pointer
-             uint8_t *output,      ///< Output RGBA 1D array pointers
-             int source_width,     /* Dimensions of unresized screenshot */
-             int source_height,
-             int target_width, /* Dimensions of screenshot after resize */
-             int target_height);
+  bool save_render ();
 
   /**
-   * Resize image to specified dimensions with bilinear interpolation algorithm
+   * Mark area of the root window as changed.
+   * Parts of the area outside of the desktop are ignored.
    */
-  static void
-  bilinear_resize (const uint8_t *input, ///< Input RGBA 1D array pointer
-                   uint8_t *output,      ///< Output RGBA 1D array pointers
-                   int source_width, /* Dimensions of unresized screenshot */
-                   int source_height,
-                   int target_width, /* Dimensions of screenshot after resize */
-                   int target_height);
-};
+  void add_damage (xcb_rectangle_t area);
 
-/**
- * Apply a horizontal box filter (low pass) to the image.
- */
-void box_blur_horizontal (uint8_t *image, int width, int height, uint radius);
-/**
- * Apply a vertical box filter (low pass) to the image.
- */
-void box_blur_vertical (uint8_t *image, int width, int height, uint radius);
+  /**
+   * Mark the whole desktop as changed
+   */
+  void damage_all ();
+
+  /**
+   * Recapture damaged areas and update matching parts of the pixmap.
+   *
+   * At most dxp_bands_per_capture bands are captured. Areas that didn't fit
+   * are left damaged.
+   */
+  void save_damage ();
+
+  /**
+   * Average the pixmap into the smaller levels
+   */
+  void save_mips ();
+
+  /**
+   * Check if the desktop changed since the previous probe by hashing a few
+   * small squares of it. Much cheaper than a capture, but may miss changes
+   * that don't touch the squares.
+   */
+  bool probe ();
+
+  /**
+   * Recapture area of the desktop and update matching part of the pixmap.
+   *
+   * Area is captured in horizontal bands. If the bands run out, area is
+   * shrunk to the part that wasn't updated and false is returned.
+   */
+  bool save_region (xcb_rectangle_t &area, uint &bands);
+
+  /**
+   * Capture part of the desktop needed to compute pixmap rows [y0, y1) and
+   * columns [x0, x1) and update them
+   */
+  void save_band (int x0, int x1, int y0, int y1);
+
+  /**
+   * Update pixmap rows [y0, y1) and columns [x0, x1) from their sources.
+   *
+   * Image holds source columns starting at left and source rows starting at
+   * top. Its rows are stride bytes long.
+   */
+  void save_sources (int x0, int x1, int y0, int y1, int left, int top,
+                     int stride);
+
+  /**
+   * Blur and sample captured band in tiles that fit into the cache.
+   *
+   * Band holds source columns starting at left and source rows starting at
+   * top. Its rows are stride bytes long.
+   */
+  void save_tiles (int x0, int x1, int y0, int y1, int left, int top,
+                   int stride);
+
+  /**
+   * Blur the sources of pixmap rows [y0, y1) and columns [x0, x1) from the
+   * captured band and sample them
+   */
+  void save_tile (int x0, int x1, int y0, int y1, int left, int top,
+                  int stride);
+
+  /**
+   * Get pixel format of the root visual.
+   *
+   * Throws runtime_error if the format is not supported.
+   */
+  static pixel_format find_pixel_format (const xcb_screen_t *screen);
+
+  /**
+   * Source column sampled for the pixmap column x
+   */
+  [[nodiscard]] int source_x (int x) const;
+
+  /**
+   * Source row sampled for the pixmap row y
+   */
+  [[nodiscard]] int source_y (int y) const;
+
+  /**
+   * First source column needed to compute the pixmap column x
+   */
+  [[nodiscard]] int source_left (int x) const;
+
+  /**
+   * Source column after the last one needed to compute the pixmap column x
+   */
+  [[nodiscard]] int source_right (int x) const;
+
+  /**
+   * First source row needed to compute the pixmap row y
+   */
+  [[nodiscard]] int source_top (int y) const;
+
+  /**
+   * Source row after the last one needed to compute the pixmap row y
+   */
+  [[nodiscard]] int source_bottom (int y) const;
+
+  /**
+   * Capture area of the desktop.
+   *
+   * Image is written into shared memory if possible. Otherwise it is sent
+   * over the socket and returned pointer belongs to the reply.
+   */
+  uint8_t *capture (
+      xcb_rectangle_t area,
+      std::unique_ptr<xcb_get_image_reply_t, decltype (&std::free)> &reply);
+
+  /**
+   * Get area of the desktop through the X socket.
+   *
+   * Returned pointer belongs to the reply and is valid until it is freed.
+   */
+  uint8_t *get_image (
+      xcb_rectangle_t area,
+      std::unique_ptr<xcb_get_image_reply_t, decltype (&std::free)> &reply)
+      const;
+
+  /**
+   * Resize image to the size of the output with nearest neighbour algorithm
+   */
+  static void nn_resize (dxp_image_view<const uint32_t> input,
+                         dxp_image_view<uint32_t> output);
+
+  /**
+   * Resize image to the size of the output with one of the separable
+   * filters. Filter must not be resize_filter::blur
+   */
+  static void resample (resize_filter filter,
+                        dxp_image_view<const uint32_t> input,
+                        dxp_image_view<uint32_t> output);
+
+private:
+  /**
+   * Set up the pixmaps and filters for this->format and the settings
+   */
+  void init_pixmaps (const dxp_tuning &tuning);
+};
 
 #endif /* ifndef DESKTOP_PIXMAP_HPP */
@@ -7,8 +7,8 @@
  *
  * At a timeout check current display and screenshot it.
  * Start a socket listener.
+ * Follow desktops and monitors that are added or removed.
  *
- * TODO Handle workspace deletions
  * TODO Handle errors
  */
 int
@@ -0,0 +1,69 @@
+#ifndef DXP_IMAGE_HPP
+#define DXP_IMAGE_HPP
+
+#include <cstddef> // for ptrdiff_t
+
+/**
+ * Rectangle of pixels stored in rows that are stride pixels apart.
+ *
+ * View doesn't own the pixels. Rows of a cropped view point into the rows
+ * of the original image, so parts of an image are processed in place.
+ * Rows of different views may alias, rows of a single view never do.
+ */
+template <typename pixel> class dxp_image_view
+{
+public:
+  pixel *data = nullptr; ///< First pixel of the first row
+  int width = 0;
+  int height = 0;
+  std::ptrdiff_t stride = 0; ///< Distance between rows in pixels
+
+  dxp_image_view () = default;
+
+  dxp_image_view (pixel *data, int width, int height, std::ptrdiff_t stride)
+      : data (data), width (width), height (height), stride (stride)
+  {
+  }
+
+  /**
+   * View of an image with rows that aren't padded
+   */
+  dxp_image_view (pixel *data, int width, int height)
+      : dxp_image_view (data, width, height, width)
+  {
+  }
+
+  /**
+   * Read only view of the same pixels
+   */
+  operator dxp_image_view<const pixel> () const
+  {
+    return { this->data, this->width, this->height, this->stride };
+  }
+
+  /**
+   * First pixel of the row y. Width pixels after it belong to the row
+   */
+  [[nodiscard]] pixel *
+  row (int y) const
+  {
+    return this->data + y * this->stride;
+  }
+
+  [[nodiscard]] pixel &
+  operator() (int x, int y) const
+  {
+    return this->row (y)[x];
+  }
+
+  /**
+   * View of the width x height rectangle with top left corner at (x, y)
+   */
+  [[nodiscard]] dxp_image_view
+  crop (int x, int y, int w, int h) const
+  {
+    return { this->row (y) + x, w, h, this->stride };
+  }
+};
+
+#endif /* ifndef DXP_IMAGE_HPP */
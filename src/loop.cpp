@@ -0,0 +1,163 @@
+#include "loop.hpp"
+#include <algorithm>      // for max
+#include <array>          // for array
+#include <cerrno>         // for errno, EINTR
+#include <csignal>        // for sigaddset, sigemptyset, SIGINT, SIGPIPE
+#include <pthread.h>      // for pthread_sigmask
+#include <sys/epoll.h>    // for epoll_event, epoll_ctl, epoll_wait, EPOLL...
+#include <sys/signalfd.h> // for signalfd, signalfd_siginfo
+#include <sys/timerfd.h>  // for timerfd_create, timerfd_settime, itimerspec
+#include <unistd.h>       // for close, read
+
+/**
+ * Create the descriptors and block the shutdown signals, so they are
+ * only read from the loop.
+ *
+ * SIGPIPE is blocked too, so writes to clients that went away fail with
+ * an error instead of killing the daemon.
+ */
+dxp_loop::dxp_loop ()
+{
+  this->fd = epoll_create1 (EPOLL_CLOEXEC);
+  if (this->fd == -1)
+    {
+      throw loop_error ("Failed to create an epoll descriptor");
+    }
+
+  // Deadlines are steady_clock time points, which is CLOCK_MONOTONIC
+  this->timer_fd
+      = timerfd_create (CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+  if (this->timer_fd == -1)
+    {
+      close (this->fd);
+      throw loop_error ("Failed to create a capture timer");
+    }
+
+  sigset_t signals;
+  sigemptyset (&signals);
+  sigaddset (&signals, SIGINT);
+  sigaddset (&signals, SIGTERM);
+  sigaddset (&signals, SIGPIPE);
+  pthread_sigmask (SIG_BLOCK, &signals, nullptr);
+
+  this->signal_fd = signalfd (-1, &signals, SFD_NONBLOCK | SFD_CLOEXEC);
+  if (this->signal_fd == -1)
+    {
+      close (this->timer_fd);
+      close (this->fd);
+      throw loop_error ("Failed to create a signal descriptor");
+    }
+
+  watch (this->timer_fd, timer);
+  watch (this->signal_fd, shutdown);
+}
+
+dxp_loop::~dxp_loop ()
+{
+  close (this->signal_fd);
+  close (this->timer_fd);
+  close (this->fd);
+}
+
+/**
+ * Report the descriptor as the source while it is readable
+ */
+void
+dxp_loop::watch (int fd, source s)
+{
+  epoll_event event{};
+  event.events = EPOLLIN;
+  event.data.u32 = s;
+  if (epoll_ctl (this->fd, EPOLL_CTL_ADD, fd, &event) == -1)
+    {
+      throw loop_error ("Failed to add a descriptor to the event loop");
+    }
+}
+
+/**
+ * Stop reporting the descriptor
+ */
+void
+dxp_loop::unwatch (int fd)
+{
+  if (epoll_ctl (this->fd, EPOLL_CTL_DEL, fd, nullptr) == -1)
+    {
+      throw loop_error ("Failed to remove a descriptor from the event loop");
+    }
+}
+
+/**
+ * Fire the timer at the deadline. time_point::max () disarms it
+ */
+void
+dxp_loop::set_deadline (std::chrono::steady_clock::time_point deadline)
+{
+  // Zero value disarms the timer, so deadlines in the past are moved to
+  // the first nanosecond of the clock
+  itimerspec spec{};
+  if (deadline != std::chrono::steady_clock::time_point::max ())
+    {
+      auto ns = std::chrono::duration_cast<std::chrono::nanoseconds> (
+                    deadline.time_since_epoch ())
+                    .count ();
+      ns = std::max<decltype (ns)> (ns, 1);
+      spec.it_value.tv_sec = ns / 1000000000;
+      spec.it_value.tv_nsec = ns % 1000000000;
+    }
+
+  timerfd_settime (this->timer_fd, TFD_TIMER_ABSTIME, &spec, nullptr);
+}
+
+/**
+ * Block until some of the sources are ready and return them.
+ *
+ * Timer and signals are consumed, other sources stay ready until their
+ * descriptors are read. Signals other than SIGPIPE are reported as
+ * shutdown.
+ */
+std::vector<dxp_loop::source>
+dxp_loop::wait ()
+{
+  std::array<epoll_event, 8> events{};
+  int count = -1;
+  while (count == -1)
+    {
+      count = epoll_wait (this->fd, events.data (), int (events.size ()), -1);
+      if (count == -1 && errno != EINTR)
+        {
+          throw loop_error ("Failed to wait for events");
+        }
+    }
+
+  std::vector<source> ready;
+  for (int i = 0; i < count; i++)
+    {
+      const auto s = source (events[size_t (i)].data.u32);
+      if (s == timer)
+        {
+          uint64_t expirations = 0;
+          if (read (this->timer_fd, &expirations, sizeof (expirations)) <= 0)
+            {
+              // Timer was moved after it fired
+              continue;
+            }
+        }
+      else if (s == shutdown)
+        {
+          signalfd_siginfo info{};
+          bool stop = false;
+          while (read (this->signal_fd, &info, sizeof (info))
+                 == sizeof (info))
+            {
+              stop = stop || info.ssi_signo != SIGPIPE;
+            }
+          if (!stop)
+            {
+              continue;
+            }
+        }
+      ready.push_back (s);
+    }
+
+  return ready;
+}
@@ -0,0 +1,87 @@
+#ifndef DXP_LOOP_HPP
+#define DXP_LOOP_HPP
+
+#include <chrono>    // for steady_clock
+#include <cstdint>   // for uint32_t
+#include <stdexcept> // for runtime_error
+#include <string>    // for string
+#include <vector>    // for vector
+
+/**
+ * Event loop of the daemon built on epoll.
+ *
+ * Watches descriptors of the X connection, the socket server and capture
+ * requests, a timer for the next capture and a signal descriptor for
+ * shutdown. Everything is handled on the thread that waits, work that may
+ * block is handed to other threads.
+ */
+class dxp_loop
+{
+public:
+  /**
+   * What a ready descriptor belongs to
+   */
+  enum source : uint32_t
+  {
+    x_server,
+    clients,
+    refresh,
+    timer,
+    shutdown,
+  };
+
+  /**
+   * Create the descriptors and block the shutdown signals, so they are
+   * only read from the loop.
+   *
+   * Signal mask is inherited, so has to be created before any other thread
+   * of the process, including the workers of the shared pool.
+   * Throws loop_error if any of the descriptors can't be created.
+   */
+  dxp_loop ();
+  ~dxp_loop ();
+
+  // Descriptors are owned by exactly one object
+  dxp_loop (const dxp_loop &other) = delete;
+  dxp_loop (dxp_loop &&other) noexcept = delete;
+  dxp_loop &operator= (const dxp_loop &other) = delete;
+  dxp_loop &operator= (dxp_loop &&other) = delete;
+
+  /**
+   * Report the descriptor as the source while it is readable
+   */
+  void watch (int fd, source s);
+
+  /**
+   * Stop reporting the descriptor
+   */
+  void unwatch (int fd);
+
+  /**
+   * Fire the timer at the deadline. time_point::max () disarms it
+   */
+  void set_deadline (std::chrono::steady_clock::time_point deadline);
+
+  /**
+   * Block until some of the sources are ready and return them.
+   *
+   * Timer and signals are consumed, other sources stay ready until their
+   * descriptors are read.
+   */
+  std::vector<source> wait ();
+
+private:
+  int fd;        ///< epoll descriptor
+  int timer_fd;  ///< Expires at the deadline
+  int signal_fd; ///< Reads SIGINT, SIGTERM and SIGPIPE
+};
+
+class loop_error : public std::runtime_error
+{
+public:
+  loop_error ()
+      : std::runtime_error ("Got an error while creating the event loop"){};
+  explicit loop_error (const std::string &msg) : std::runtime_error (msg){};
+};
+
+#endif /* ifndef DXP_LOOP_HPP */
@@ -0,0 +1,137 @@
+#include "pool.hpp"
+#include "tune.hpp"   // for dxp_tuning
+#include <algorithm>  // for find, max
+
+/**
+ * Start workers. Zero threads means one per CPU core. With one thread
+ * everything is run on the calling thread.
+ */
+dxp_pool::dxp_pool (uint threads)
+{
+  if (threads == 0)
+    {
+      threads = std::max (std::thread::hardware_concurrency (), 1U);
+    }
+
+  // Calling thread is one of the threads
+  for (uint i = 1; i < threads; i++)
+    {
+      this->workers.emplace_back (&dxp_pool::work, this);
+    }
+}
+
+dxp_pool::~dxp_pool ()
+{
+  {
+    std::scoped_lock<std::mutex> guard (this->lock);
+    this->stopping = true;
+  }
+  this->wake.notify_all ();
+
+  for (auto &worker : this->workers)
+    {
+      worker.join ();
+    }
+}
+
+/**
+ * Run task (i) for i in [0, count) and wait until all of them finish.
+ * Calling thread runs tasks too. Tasks must not throw.
+ */
+void
+dxp_pool::run (int count, const std::function<void (int)> &task)
+{
+  if (this->workers.empty () || count <= 1)
+    {
+      for (int i = 0; i < count; i++)
+        {
+          task (i);
+        }
+      return;
+    }
+
+  job j{ &task, count };
+
+  std::unique_lock<std::mutex> guard (this->lock);
+  this->jobs.push_back (&j);
+  this->wake.notify_all ();
+
+  while (run_next (j, guard))
+    {
+    }
+
+  // Workers may still be running the last tasks
+  this->finish.wait (guard, [&] { return j.done == j.count; });
+}
+
+/**
+ * Number of threads that run tasks, including the calling one
+ */
+uint
+dxp_pool::size () const
+{
+  return uint (this->workers.size ()) + 1;
+}
+
+/**
+ * Pool with the tuned number of threads, started on the first use
+ */
+dxp_pool &
+dxp_pool::shared ()
+{
+  static dxp_pool pool (dxp_tuning::current ().threads);
+  return pool;
+}
+
+/**
+ * Take tasks until the pool stops
+ */
+void
+dxp_pool::work ()
+{
+  std::unique_lock<std::mutex> guard (this->lock);
+  while (true)
+    {
+      this->wake.wait (guard,
+                       [&] { return this->stopping || !this->jobs.empty (); });
+      if (this->stopping)
+        {
+          return;
+        }
+
+      run_next (*this->jobs.front (), guard);
+    }
+}
+
+/**
+ * Take the next task of the job and run it.
+ *
+ * Lock is released while the task runs. Returns false if all of the tasks
+ * were taken.
+ */
+bool
+dxp_pool::run_next (job &j, std::unique_lock<std::mutex> &guard)
+{
+  if (j.next == j.count)
+    {
+      return false;
+    }
+
+  const int i = j.next++;
+
+  // Job can't be taken from anymore, but it lives until its tasks finish
+  if (j.next == j.count)
+    {
+      this->jobs.erase (std::find (this->jobs.begin (), this->jobs.end (), &j));
+    }
+
+  guard.unlock ();
+  (*j.task) (i);
+  guard.lock ();
+
+  if (++j.done == j.count)
+    {
+      this->finish.notify_all ();
+    }
+  return true;
+}
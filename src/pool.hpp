@@ -0,0 +1,83 @@
+#ifndef DXP_POOL_HPP
+#define DXP_POOL_HPP
+
+#include <condition_variable> // for condition_variable
+#include <deque>              // for deque
+#include <functional>         // for function
+#include <mutex>              // for mutex
+#include <sys/types.h>        // for uint
+#include <thread>             // for thread
+#include <vector>             // for vector
+
+/**
+ * Persistent worker threads for image processing.
+ *
+ * Work is split into independent tasks numbered from 0. Several threads
+ * may run their tasks at once, workers take them in order of submission.
+ */
+class dxp_pool
+{
+public:
+  /**
+   * Start workers. Zero threads means one per CPU core. With one thread
+   * everything is run on the calling thread.
+   */
+  explicit dxp_pool (uint threads);
+  ~dxp_pool ();
+
+  // Threads are owned by exactly one object
+  dxp_pool (const dxp_pool &other) = delete;
+  dxp_pool (dxp_pool &&other) noexcept = delete;
+  dxp_pool &operator= (const dxp_pool &other) = delete;
+  dxp_pool &operator= (dxp_pool &&other) = delete;
+
+  /**
+   * Run task (i) for i in [0, count) and wait until all of them finish.
+   * Calling thread runs tasks too. Tasks must not throw.
+   */
+  void run (int count, const std::function<void (int)> &task);
+
+  /**
+   * Number of threads that run tasks, including the calling one
+   */
+  uint size () const;
+
+  /**
+   * Pool with the tuned number of threads, started on the first use
+   */
+  static dxp_pool &shared ();
+
+private:
+  /**
+   * Tasks submitted by a single run call
+   */
+  struct job
+  {
+    const std::function<void (int)> *task;
+    int count;
+    int next = 0; ///< First task that wasn't taken
+    int done = 0; ///< Number of finished tasks
+  };
+
+  std::vector<std::thread> workers;
+  std::mutex lock;                ///< Guards everything below
+  std::condition_variable wake;   ///< Jobs were submitted or pool stops
+  std::condition_variable finish; ///< Some job finished
+  std::deque<job *> jobs;         ///< Jobs that have tasks to take
+  bool stopping = false;
+
+  /**
+   * Take tasks until the pool stops
+   */
+  void work ();
+
+  /**
+   * Take the next task of the job and run it.
+   *
+   * Lock is released while the task runs. Returns false if all of the tasks
+   * were taken.
+   */
+  bool run_next (job &j, std::unique_lock<std::mutex> &guard);
+};
+
+#endif /* ifndef DXP_POOL_HPP */
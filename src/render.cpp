@@ -0,0 +1,169 @@
+#include "render.hpp"
+#include "config.hpp"   // for dxp_render_filter
+#include "xcb_util.hpp" // for check, xcb_unique_ptr
+#include <algorithm>    // for copy_n, max
+#include <cmath>        // for lround
+#include <cstdlib>      // for free
+#include <vector>       // for vector
+
+/**
+ * Get picture format of the visual
+ */
+static xcb_render_pictformat_t
+find_visual_format (xcb_connection_t *c, xcb_visualid_t visual)
+{
+  xcb_generic_error_t *e = nullptr;
+  auto formats = xcb_unique_ptr<xcb_render_query_pict_formats_reply_t> (
+      xcb_render_query_pict_formats_reply (
+          c, xcb_render_query_pict_formats (c), &e));
+  check (e, "XCB error while getting picture formats reply");
+
+  for (auto screens
+       = xcb_render_query_pict_formats_screens_iterator (formats.get ());
+       screens.rem; xcb_render_pictscreen_next (&screens))
+    {
+      for (auto depths = xcb_render_pictscreen_depths_iterator (screens.data);
+           depths.rem; xcb_render_pictdepth_next (&depths))
+        {
+          for (auto visuals
+               = xcb_render_pictdepth_visuals_iterator (depths.data);
+               visuals.rem; xcb_render_pictvisual_next (&visuals))
+            {
+              if (visuals.data->visual == visual)
+                {
+                  return visuals.data->format;
+                }
+            }
+        }
+    }
+
+  throw render_error ("Could not find picture format of the root visual");
+}
+
+dxp_render::dxp_render (xcb_connection_t *c, xcb_screen_t *screen,
+                        int16_t x, int16_t y, uint16_t area_width,
+                        uint16_t area_height, uint16_t width, uint16_t height)
+{
+  this->c = c;
+  this->width = width;
+  this->height = height;
+
+  if (!is_available (c))
+    {
+      throw render_error ("RENDER extension is not supported by the X server");
+    }
+
+  auto format = find_visual_format (c, screen->root_visual);
+
+  this->pixmap = xcb_generate_id (c);
+  xcb_create_pixmap (c, screen->root_depth, this->pixmap, screen->root, width,
+                     height);
+
+  this->target = xcb_generate_id (c);
+  xcb_render_create_picture (c, this->target, this->pixmap, format, 0,
+                             nullptr);
+
+  // Windows are drawn on top of the root and have to be included
+  const uint32_t subwindow_mode = XCB_SUBWINDOW_MODE_INCLUDE_INFERIORS;
+  this->source = xcb_generate_id (c);
+  xcb_render_create_picture (c, this->source, screen->root, format,
+                             XCB_RENDER_CP_SUBWINDOW_MODE, &subwindow_mode);
+
+  // Transform maps target pixels to source pixels.
+  // Scales the thumbnail up to the area and moves it to the area's corner
+  constexpr double k_fixed_one = 1 << 16; ///< 1.0 in 16.16 fixed point
+  const double x_ratio = double (area_width) / width;
+  const double y_ratio = double (area_height) / height;
+
+  xcb_render_transform_t transform = {};
+  transform.matrix11 = xcb_render_fixed_t (x_ratio * k_fixed_one);
+  transform.matrix13 = xcb_render_fixed_t (x * k_fixed_one);
+  transform.matrix22 = xcb_render_fixed_t (y_ratio * k_fixed_one);
+  transform.matrix23 = xcb_render_fixed_t (y * k_fixed_one);
+  transform.matrix33 = xcb_render_fixed_t (k_fixed_one);
+  xcb_render_set_picture_transform (c, this->source, transform);
+
+  // Convolution filter is a box blur covering the whole source footprint of
+  // the target pixel. Other filters don't take parameters
+  std::vector<xcb_render_fixed_t> params;
+  if (dxp_render_filter == "convolution")
+    {
+      auto kw = std::max (std::lround (x_ratio), 1L);
+      auto kh = std::max (std::lround (y_ratio), 1L);
+
+      params.push_back (xcb_render_fixed_t (kw * k_fixed_one));
+      params.push_back (xcb_render_fixed_t (kh * k_fixed_one));
+      params.resize (size_t (2 + kw * kh),
+                     xcb_render_fixed_t (k_fixed_one / double (kw * kh)));
+    }
+
+  auto *e = xcb_request_check (
+      c, xcb_render_set_picture_filter_checked (
+             c, this->source, dxp_render_filter.size (),
+             dxp_render_filter.c_str (), params.size (), params.data ()));
+  if (e != nullptr)
+    {
+      // Destructor doesn't run for a constructor that throws
+      std::free (e);
+      xcb_render_free_picture (c, this->source);
+      xcb_render_free_picture (c, this->target);
+      xcb_free_pixmap (c, this->pixmap);
+      xcb_flush (c);
+      throw render_error ("X server does not support \"" + dxp_render_filter
+                          + "\" RENDER filter");
+    }
+}
+
+dxp_render::~dxp_render ()
+{
+  xcb_render_free_picture (this->c, this->source);
+  xcb_render_free_picture (this->c, this->target);
+  xcb_free_pixmap (this->c, this->pixmap);
+  xcb_flush (this->c);
+}
+
+/**
+ * Check if the server supports RENDER with transforms (version 0.6)
+ */
+bool
+dxp_render::is_available (xcb_connection_t *c)
+{
+  const auto *ext = xcb_get_extension_data (c, &xcb_render_id);
+  if (ext == nullptr || !ext->present)
+    {
+      return false;
+    }
+
+  xcb_generic_error_t *e = nullptr;
+  auto version = xcb_unique_ptr<xcb_render_query_version_reply_t> (
+      xcb_render_query_version_reply (c, xcb_render_query_version (c, 0, 11),
+                                      &e));
+  std::free (e);
+
+  return version != nullptr
+         && (version->major_version > 0 || version->minor_version >= 6);
+}
+
+/**
+ * Downscale the area and copy the result into output
+ */
+void
+dxp_render::get_image (uint8_t *output)
+{
+  xcb_render_composite (this->c, XCB_RENDER_PICT_OP_SRC, this->source,
+                        XCB_NONE, this->target, 0, 0, 0, 0, 0, 0, this->width,
+                        this->height);
+
+  // Only the thumbnail is transferred over the socket
+  xcb_generic_error_t *e = nullptr;
+  auto reply = xcb_unique_ptr<xcb_get_image_reply_t> (xcb_get_image_reply (
+      this->c,
+      xcb_get_image (this->c, XCB_IMAGE_FORMAT_Z_PIXMAP, this->pixmap, 0, 0,
+                     this->width, this->height, uint32_t (~0)),
+      &e));
+  check (e, "XCB error while getting downscaled image reply");
+
+  auto len = std::min (xcb_get_image_data_length (reply.get ()),
+                       this->width * this->height * 4);
+  std::copy_n (xcb_get_image_data (reply.get ()), len, output);
+}
@@ -0,0 +1,69 @@
+#ifndef DXP_RENDER_HPP
+#define DXP_RENDER_HPP
+
+#include <cstdint>      // for uint8_t, int16_t, uint16_t
+#include <stdexcept>    // for runtime_error
+#include <string>       // for string
+#include <xcb/render.h> // for xcb_render_picture_t
+#include <xcb/xcb.h>    // for xcb_connection_t
+#include <xcb/xproto.h> // for xcb_screen_t, xcb_pixmap_t
+
+/**
+ * Downscales part of the screen on the X server with RENDER extension.
+ *
+ * Root window is composited through a scaling transform into a pixmap with
+ * the size of the thumbnail, so only the thumbnail leaves the X server.
+ */
+class dxp_render
+{
+public:
+  uint16_t width;  ///< Width of the downscaled image
+  uint16_t height; ///< Height of the downscaled image
+
+  /**
+   * Create pictures that downscale area of the screen to width x height.
+   *
+   * Throws render_error if the extension or the filter is not supported.
+   */
+  dxp_render (xcb_connection_t *c, xcb_screen_t *screen,
+              int16_t x,      ///< x coordinate of the area on the screen
+              int16_t y,      ///< y coordinate of the area on the screen
+              uint16_t area_width, uint16_t area_height, uint16_t width,
+              uint16_t height);
+  ~dxp_render ();
+
+  // Server side resources are owned by exactly one object
+  dxp_render (const dxp_render &other) = delete;
+  dxp_render (dxp_render &&other) noexcept = delete;
+  dxp_render &operator= (const dxp_render &other) = delete;
+  dxp_render &operator= (dxp_render &&other) = delete;
+
+  /**
+   * Check if the server supports RENDER with transforms (version 0.6)
+   */
+  static bool is_available (xcb_connection_t *c);
+
+  /**
+   * Downscale the area and copy the result into output.
+   *
+   * Output must have space for width * height 32 bit pixels.
+   * Throws xcb_error if the server refused the request.
+   */
+  void get_image (uint8_t *output);
+
+private:
+  xcb_connection_t *c;
+  xcb_pixmap_t pixmap;         ///< Server side storage for the thumbnail
+  xcb_render_picture_t source; ///< Root window with scaling transform
+  xcb_render_picture_t target; ///< Picture of the pixmap
+};
+
+class render_error : public std::runtime_error
+{
+public:
+  render_error ()
+      : std::runtime_error ("Got an error while setting up RENDER pictures"){};
+  explicit render_error (const std::string &msg) : std::runtime_error (msg){};
+};
+
+#endif /* ifndef DXP_RENDER_HPP */
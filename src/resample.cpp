@@ -0,0 +1,453 @@
+#include "resample.hpp"
+#include <algorithm> // for max, min, clamp, fill_n
+#include <cmath>     // for floor, ceil, fabs, sin, llround
+#include <cstddef>   // for size_t
+#include <numbers>   // for pi
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h> // for __m128i, _mm_add_epi16, _mm_packus_epi16...
+#define DXP_RESAMPLE_SIMD
+#endif
+
+/// Weights along each axis sum to 1 << k_weight_bits. Column sums fit into
+/// 32 bits, sums of both passes are kept in 64 bits
+constexpr int k_weight_bits = 14;
+
+/**
+ * Triangle kernel of the bilinear filter
+ */
+static double
+triangle (double x)
+{
+  return std::max (0.0, 1 - std::fabs (x));
+}
+
+/**
+ * Catmull-Rom spline. Bicubic kernel with a = -0.5
+ */
+static double
+cubic (double x)
+{
+  x = std::fabs (x);
+  if (x < 1)
+    {
+      return (1.5 * x - 2.5) * x * x + 1;
+    }
+  if (x < 2)
+    {
+      return ((-0.5 * x + 2.5) * x - 4) * x + 2;
+    }
+  return 0;
+}
+
+/**
+ * Normalized sinc
+ */
+static double
+sinc (double x)
+{
+  if (x == 0)
+    {
+      return 1;
+    }
+  x *= std::numbers::pi;
+  return std::sin (x) / x;
+}
+
+/**
+ * Lanczos kernel with n lobes
+ */
+template <int n>
+static double
+lanczos (double x)
+{
+  return std::fabs (x) < n ? sinc (x) * sinc (x / n) : 0;
+}
+
+/**
+ * Weights of the filter for a line of source_size pixels resized to
+ * target_size pixels. Filter must not be resize_filter::blur.
+ */
+dxp_resample_axis
+dxp_resample_axis::make (resize_filter filter, int source_size,
+                         int target_size)
+{
+  switch (filter)
+    {
+    case resize_filter::bilinear:
+      return convolution (source_size, target_size, triangle, 1);
+    case resize_filter::bicubic:
+      return convolution (source_size, target_size, cubic, 2);
+    case resize_filter::lanczos2:
+      return convolution (source_size, target_size, lanczos<2>, 2);
+    case resize_filter::lanczos3:
+      return convolution (source_size, target_size, lanczos<3>, 3);
+    default:
+      return area (source_size, target_size);
+    }
+}
+
+/**
+ * Weights that average source pixels covered by each target pixel.
+ *
+ * Coordinates are scaled by source_size * target_size, so pixel edges of
+ * both lines are integers. Weights are differences of rounded cumulative
+ * coverage, so they sum to exactly 1 << k_weight_bits.
+ */
+dxp_resample_axis
+dxp_resample_axis::area (int source_size, int target_size)
+{
+  dxp_resample_axis axis;
+  axis.first.resize (size_t (target_size));
+  axis.count.resize (size_t (target_size));
+
+  // Target pixel covers at most ceil (source / target) + 1 source pixels
+  axis.taps = (source_size + target_size - 1) / target_size + 1;
+  axis.weights.assign (size_t (target_size) * size_t (axis.taps), 0);
+
+  const int64_t s = source_size;
+  const int64_t t = target_size;
+
+  for (int64_t x = 0; x < t; x++)
+    {
+      // Target pixel x covers [x * s, (x + 1) * s) in scaled coordinates
+      const int64_t begin = x * s;
+      const int64_t end = begin + s;
+      const int first = int (begin / t);
+      const int last = int ((end - 1) / t);
+
+      axis.first[size_t (x)] = first;
+      axis.count[size_t (x)] = last - first + 1;
+
+      int16_t *weights = &axis.weights[size_t (x * axis.taps)];
+      int64_t previous = 0;
+      for (int i = 0; i <= last - first; i++)
+        {
+          const int64_t covered = std::min ((first + i + 1) * t, end) - begin;
+          const int64_t cumulative
+              = ((covered << k_weight_bits) + s / 2) / s;
+          weights[i] = int16_t (cumulative - previous);
+          previous = cumulative;
+        }
+    }
+
+  return axis;
+}
+
+/**
+ * Weights of a symmetric kernel that is nonzero on (-support, support).
+ *
+ * Pixel i covers [i, i + 1), so target pixel x is centered at
+ * (x + 0.5) * source_size / target_size in source coordinates. Kernel is
+ * stretched by the scale factor when downscaling. Pixels outside of the
+ * line are dropped and the rest are normalized. Like with area weights,
+ * fixed point weights are differences of rounded cumulative sums.
+ */
+dxp_resample_axis
+dxp_resample_axis::convolution (int source_size, int target_size,
+                                double (*kernel) (double), double support)
+{
+  dxp_resample_axis axis;
+  axis.first.resize (size_t (target_size));
+  axis.count.resize (size_t (target_size));
+
+  const double scale = double (source_size) / target_size;
+  const double stretch = std::max (scale, 1.0);
+  const double radius = support * stretch;
+
+  for (int x = 0; x < target_size; x++)
+    {
+      // Pixel i contributes if |i + 0.5 - center| < radius
+      const double center = (x + 0.5) * scale;
+      const int first = std::max (
+          int (std::floor (center - radius - 0.5)) + 1, 0);
+      const int last = std::min (int (std::ceil (center + radius - 0.5)) - 1,
+                                 source_size - 1);
+
+      axis.first[size_t (x)] = first;
+      axis.count[size_t (x)] = last - first + 1;
+      axis.taps = std::max (axis.taps, last - first + 1);
+    }
+
+  axis.weights.assign (size_t (target_size) * size_t (axis.taps), 0);
+
+  std::vector<double> kernel_values (size_t (axis.taps));
+  double *w = kernel_values.data ();
+  for (int x = 0; x < target_size; x++)
+    {
+      const double center = (x + 0.5) * scale;
+      const int first = axis.first[size_t (x)];
+      const int count = axis.count[size_t (x)];
+      int16_t *weights = &axis.weights[size_t (x * axis.taps)];
+
+      double total = 0;
+      for (int i = 0; i < count; i++)
+        {
+          w[i] = kernel ((first + i + 0.5 - center) / stretch);
+          total += w[i];
+        }
+
+      double cumulative = 0;
+      int64_t previous = 0;
+      for (int i = 0; i < count; i++)
+        {
+          cumulative += w[i] / total;
+          const int64_t rounded
+              = i == count - 1
+                    ? int64_t (1) << k_weight_bits
+                    : std::llround (cumulative * (1 << k_weight_bits));
+          weights[i] = int16_t (rounded - previous);
+          previous = rounded;
+        }
+    }
+
+  return axis;
+}
+
+dxp_resampler::dxp_resampler (resize_filter filter, int source_width,
+                              int source_height, int target_width,
+                              int target_height)
+    : columns (dxp_resample_axis::make (filter, source_width, target_width)),
+      rows (dxp_resample_axis::make (filter, source_height, target_height))
+{
+}
+
+/**
+ * Add a source row weighted by w to per channel column sums.
+ *
+ * Loop runs over a contiguous row without branches, so the compiler
+ * vectorizes it for the target of the caller.
+ */
+__attribute__ ((always_inline)) static inline void
+accumulate_row (const uint32_t *__restrict line, int32_t w, int n,
+                int32_t *__restrict r, int32_t *__restrict g,
+                int32_t *__restrict b)
+{
+  for (int x = 0; x < n; x++)
+    {
+      r[x] += w * int32_t ((line[x] >> 16) & 0xFF);
+      g[x] += w * int32_t ((line[x] >> 8) & 0xFF);
+      b[x] += w * int32_t (line[x] & 0xFF);
+    }
+}
+
+static void
+accumulate_row_generic (const uint32_t *line, int32_t w, int n, int32_t *r,
+                        int32_t *g, int32_t *b)
+{
+  accumulate_row (line, w, n, r, g, b);
+}
+
+#ifdef DXP_RESAMPLE_SIMD
+/**
+ * Same as accumulate_row_generic. AVX2 multiplies eight 32 bit lanes at
+ * once, SSE2 has no 32 bit multiplication at all.
+ */
+__attribute__ ((target ("avx2"))) static void
+accumulate_row_avx2 (const uint32_t *line, int32_t w, int n, int32_t *r,
+                     int32_t *g, int32_t *b)
+{
+  accumulate_row (line, w, n, r, g, b);
+}
+#endif
+
+/**
+ * Compute columns [x0, x1) of the target row y.
+ *
+ * Image holds the part of the source with top left corner at (left, top).
+ * Pixels are bgra8888 and alpha of the output is 0. Uses AVX2 if the CPU
+ * supports it, output is the same as of resample_row_scalar.
+ */
+void
+dxp_resampler::resample_row (dxp_image_view<const uint32_t> image, int left,
+                             int top, int y, int x0, int x1,
+                             uint32_t *output) const
+{
+#ifdef DXP_RESAMPLE_SIMD
+  static const auto accumulate = __builtin_cpu_supports ("avx2")
+                                     ? accumulate_row_avx2
+                                     : accumulate_row_generic;
+#else
+  static const auto accumulate = accumulate_row_generic;
+#endif
+
+  resample_row (accumulate, image, left, top, y, x0, x1, output);
+}
+
+/**
+ * Same as resample_row without runtime dispatch. Reference for tests
+ */
+void
+dxp_resampler::resample_row_scalar (dxp_image_view<const uint32_t> image,
+                                    int left, int top, int y, int x0, int x1,
+                                    uint32_t *output) const
+{
+  resample_row (accumulate_row_generic, image, left, top, y, x0, x1, output);
+}
+
+/**
+ * Compute columns [x0, x1) of the target row y, summing source rows with
+ * accumulate.
+ *
+ * Source rows are summed into per channel column sums first, then column
+ * sums are weighted along the row. Results of filters with negative
+ * weights are clamped.
+ */
+void
+dxp_resampler::resample_row (accumulate_fn accumulate,
+                             dxp_image_view<const uint32_t> image, int left,
+                             int top, int y, int x0, int x1,
+                             uint32_t *output) const
+{
+  // Source columns covered by the target columns
+  const int *column_first = this->columns.first.data ();
+  const int *column_count = this->columns.count.data ();
+  const int begin = column_first[x0];
+  const int end = column_first[x1 - 1] + column_count[x1 - 1];
+  const int n = end - begin;
+
+  // Per channel sums of source columns weighted along the column
+  thread_local std::vector<int32_t> sum_r;
+  thread_local std::vector<int32_t> sum_g;
+  thread_local std::vector<int32_t> sum_b;
+  sum_r.resize (std::max (sum_r.size (), size_t (n)));
+  sum_g.resize (sum_r.size ());
+  sum_b.resize (sum_r.size ());
+  int32_t *r = sum_r.data ();
+  int32_t *g = sum_g.data ();
+  int32_t *b = sum_b.data ();
+  std::fill_n (r, n, 0);
+  std::fill_n (g, n, 0);
+  std::fill_n (b, n, 0);
+
+  const int16_t *row_weights = this->rows.weights.data () + y * this->rows.taps;
+  const int row_first = this->rows.first[size_t (y)];
+  for (int i = 0; i < this->rows.count[size_t (y)]; i++)
+    {
+      const int32_t w = row_weights[i];
+      const uint32_t *line = image.row (row_first + i - top) + (begin - left);
+      accumulate (line, w, n, r, g, b);
+    }
+
+  constexpr int shift = 2 * k_weight_bits;
+  constexpr int64_t half = int64_t (1) << (shift - 1);
+
+  for (int x = x0; x < x1; x++)
+    {
+      int64_t sr = half;
+      int64_t sg = half;
+      int64_t sb = half;
+
+      const int first = column_first[x] - begin;
+      const int16_t *w = this->columns.weights.data () + x * this->columns.taps;
+      for (int i = 0; i < column_count[x]; i++)
+        {
+          sr += int64_t (w[i]) * r[first + i];
+          sg += int64_t (w[i]) * g[first + i];
+          sb += int64_t (w[i]) * b[first + i];
+        }
+
+      output[x - x0] = uint32_t (std::clamp<int64_t> (sr >> shift, 0, 255))
+                           << 16
+                       | uint32_t (std::clamp<int64_t> (sg >> shift, 0, 255))
+                             << 8
+                       | uint32_t (std::clamp<int64_t> (sb >> shift, 0, 255));
+    }
+}
+
+/**
+ * Average 2x2 blocks of two bgra8888 rows. Reference version
+ */
+static void
+halve_rows_scalar (const uint32_t *row0, const uint32_t *row1,
+                   uint32_t *output, int x, int width)
+{
+  for (; x < width; x++)
+    {
+      const uint32_t p[4]
+          = { row0[2 * x], row0[2 * x + 1], row1[2 * x], row1[2 * x + 1] };
+
+      uint32_t result = 0;
+      for (int shift = 0; shift < 32; shift += 8)
+        {
+          uint32_t sum = 2;
+          for (auto pixel : p)
+            {
+              sum += (pixel >> shift) & 0xFF;
+            }
+          result |= (sum >> 2) << shift;
+        }
+      output[x] = result;
+    }
+}
+
+#ifdef DXP_RESAMPLE_SIMD
+/**
+ * Sum a pair of pixels from each row into 16 bit channels of a pixel
+ */
+__attribute__ ((target ("sse2"))) static inline __m128i
+sum_pairs (__m128i a, __m128i b)
+{
+  const __m128i zero = _mm_setzero_si128 ();
+
+  // Pixels 0 and 1, 2 and 3 of both rows with a channel per 16 bits
+  const __m128i lo = _mm_add_epi16 (_mm_unpacklo_epi8 (a, zero),
+                                    _mm_unpacklo_epi8 (b, zero));
+  const __m128i hi = _mm_add_epi16 (_mm_unpackhi_epi8 (a, zero),
+                                    _mm_unpackhi_epi8 (b, zero));
+
+  // Sums of pixels 0 and 1 in the low half, 2 and 3 in the high one
+  return _mm_unpacklo_epi64 (_mm_add_epi16 (lo, _mm_srli_si128 (lo, 8)),
+                             _mm_add_epi16 (hi, _mm_srli_si128 (hi, 8)));
+}
+
+/**
+ * Average 2x2 blocks of two rows, four output pixels at a time
+ */
+__attribute__ ((target ("sse2"))) static void
+halve_rows_sse2 (const uint32_t *row0, const uint32_t *row1, uint32_t *output,
+                 int width)
+{
+  const __m128i two = _mm_set1_epi16 (2);
+
+  int x = 0;
+  for (; x + 4 <= width; x += 4)
+    {
+      const auto *a = reinterpret_cast<const __m128i *> (row0 + 2 * x);
+      const auto *b = reinterpret_cast<const __m128i *> (row1 + 2 * x);
+
+      const __m128i first = _mm_srli_epi16 (
+          _mm_add_epi16 (sum_pairs (_mm_loadu_si128 (a), _mm_loadu_si128 (b)),
+                         two),
+          2);
+      const __m128i second = _mm_srli_epi16 (
+          _mm_add_epi16 (
+              sum_pairs (_mm_loadu_si128 (a + 1), _mm_loadu_si128 (b + 1)),
+              two),
+          2);
+      _mm_storeu_si128 (reinterpret_cast<__m128i *> (output + x),
+                        _mm_packus_epi16 (first, second));
+    }
+
+  halve_rows_scalar (row0, row1, output, x, width);
+}
+#endif
+
+/**
+ * Average 2x2 blocks of two bgra8888 rows into width pixels of the output.
+ *
+ * Rows hold at least 2 * width pixels. Uses SSE2 if the CPU supports it.
+ */
+void
+halve_rows (const uint32_t *row0, const uint32_t *row1, uint32_t *output,
+            int width)
+{
+#ifdef DXP_RESAMPLE_SIMD
+  if (__builtin_cpu_supports ("sse2"))
+    {
+      halve_rows_sse2 (row0, row1, output, width);
+      return;
+    }
+#endif
+  halve_rows_scalar (row0, row1, output, 0, width);
+}
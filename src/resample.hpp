@@ -0,0 +1,105 @@
+#ifndef DXP_RESAMPLE_HPP
+#define DXP_RESAMPLE_HPP
+
+#include "config.hpp"  // for resize_filter
+#include "image.hpp"   // for dxp_image_view
+#include <cstdint>     // for uint32_t, int16_t
+#include <sys/types.h> // for uint
+#include <vector>      // for vector
+
+/**
+ * Source pixels that contribute to each pixel of a resized line and their
+ * weights in fixed point. Weights of a pixel sum to 1 << k_weight_bits.
+ *
+ * Weights of interpolating filters may be negative.
+ */
+class dxp_resample_axis
+{
+public:
+  std::vector<int> first; ///< First contributing source pixel
+  std::vector<int> count; ///< Number of contributing source pixels
+  int taps = 0;           ///< Space reserved for the weights of a pixel
+  /// Weight of source pixel first[t] + i for target pixel t is at
+  /// t * taps + i
+  std::vector<int16_t> weights;
+
+  /**
+   * Weights of the filter for a line of source_size pixels resized to
+   * target_size pixels. Filter must not be resize_filter::blur.
+   */
+  static dxp_resample_axis make (resize_filter filter, int source_size,
+                                 int target_size);
+
+  /**
+   * Weights that average source pixels covered by each target pixel
+   */
+  static dxp_resample_axis area (int source_size, int target_size);
+
+  /**
+   * Weights of a symmetric kernel that is nonzero on (-support, support).
+   *
+   * Kernel is stretched by the scale factor when downscaling, so it covers
+   * all of the source pixels under the target pixel.
+   */
+  static dxp_resample_axis convolution (int source_size, int target_size,
+                                        double (*kernel) (double),
+                                        double support);
+};
+
+/**
+ * Resizes images with separable filters.
+ *
+ * Contributions of source rows and columns are computed once for the pair
+ * of sizes. Each source pixel is read once per target row it contributes
+ * to, and the source is never written to. Rows may be computed from
+ * several threads at once.
+ */
+class dxp_resampler
+{
+public:
+  dxp_resample_axis columns; ///< Contributions along the rows
+  dxp_resample_axis rows;    ///< Contributions along the columns
+
+  dxp_resampler (resize_filter filter, int source_width, int source_height,
+                 int target_width, int target_height);
+
+  /**
+   * Compute columns [x0, x1) of the target row y.
+   *
+   * Image holds the part of the source with top left corner at (left, top).
+   * Pixels are bgra8888 and alpha of the output is 0. Uses AVX2 if the CPU
+   * supports it, output is the same as of resample_row_scalar.
+   */
+  void resample_row (dxp_image_view<const uint32_t> image, int left, int top,
+                     int y, int x0, int x1, uint32_t *output) const;
+
+  /**
+   * Same as resample_row without runtime dispatch. Reference for tests
+   */
+  void resample_row_scalar (dxp_image_view<const uint32_t> image, int left,
+                            int top, int y, int x0, int x1,
+                            uint32_t *output) const;
+
+private:
+  /// Adds a source row weighted by w to per channel column sums
+  using accumulate_fn = void (*) (const uint32_t *line, int32_t w, int n,
+                                  int32_t *r, int32_t *g, int32_t *b);
+
+  /**
+   * Compute columns [x0, x1) of the target row y, summing source rows with
+   * accumulate
+   */
+  void resample_row (accumulate_fn accumulate,
+                     dxp_image_view<const uint32_t> image, int left, int top,
+                     int y, int x0, int x1, uint32_t *output) const;
+};
+
+/**
+ * Average 2x2 blocks of two bgra8888 rows into width pixels of the output.
+ *
+ * Rows hold at least 2 * width pixels. Uses SSE2 if the CPU supports it.
+ */
+void halve_rows (const uint32_t *row0, const uint32_t *row1, uint32_t *output,
+                 int width);
+
+#endif /* ifndef DXP_RESAMPLE_HPP */
@@ -0,0 +1,138 @@
+#include "scheduler.hpp"
+#include "config.hpp"   // for dxp_cpu_budget, dxp_min_screenshot_period
+#include <algorithm>    // for clamp, max
+#include <ctime>        // for clock_gettime, timespec, CLOCK_THREAD_CPU...
+#include <filesystem>   // for directory_iterator, path
+#include <fstream>      // for ifstream
+#include <string>       // for string, operator==
+#include <system_error> // for error_code
+
+/// Weight of the latest measurement in smoothed values
+constexpr double k_smoothing = 0.25;
+
+/// Power supply state changes rarely, so sysfs isn't read on every capture
+constexpr auto k_battery_check_period = std::chrono::seconds (30);
+
+/**
+ * Start measuring a capture. No tasks run at the time
+ */
+void
+dxp_scheduler::start ()
+{
+  this->task_cpu = std::chrono::duration<double> (0);
+  this->task_wait = std::chrono::duration<double> (0);
+}
+
+/**
+ * Add a task that captured something and just finished on the calling
+ * thread.
+ *
+ * Time the task spent off the CPU is mostly spent waiting for the images
+ * it requested, so the latency of the X server is measured on the replies
+ * the capture needs anyway, without extra round trips.
+ */
+void
+dxp_scheduler::add (const task &t)
+{
+  const auto cpu = thread_cpu_time () - t.cpu;
+  const std::chrono::duration<double> wall
+      = std::chrono::steady_clock::now () - t.wall;
+
+  std::scoped_lock<std::mutex> guard (this->lock);
+  this->task_cpu += cpu;
+  this->task_wait = std::max (this->task_wait, wall - cpu);
+}
+
+/**
+ * Finish measuring the capture and get time until the next one.
+ *
+ * Capture may take at most budget share of the period. Ticks that found
+ * nothing to capture keep the previous period, as their cost says nothing
+ * about the cost of the next real capture.
+ *
+ * Cost only counts the tasks that updated desktops. Sharing the result and
+ * serving clients run on other threads or after the tasks and aren't
+ * included.
+ */
+std::chrono::steady_clock::duration
+dxp_scheduler::finish (bool captured)
+{
+  if (!captured)
+    {
+      return std::clamp<std::chrono::steady_clock::duration> (
+          this->period, dxp_min_screenshot_period, dxp_max_screenshot_period);
+    }
+
+  this->cost += k_smoothing * (this->task_cpu - this->cost);
+  this->latency += k_smoothing * (this->task_wait - this->latency);
+
+  auto now = std::chrono::steady_clock::now ();
+  if (now >= this->next_battery_check)
+    {
+      this->battery = on_battery ();
+      this->next_battery_check = now + k_battery_check_period;
+    }
+
+  const double budget = this->battery ? dxp_battery_cpu_budget : dxp_cpu_budget;
+  this->period
+      = std::chrono::duration_cast<std::chrono::steady_clock::duration> (
+          (this->cost + this->latency) / budget);
+
+  return std::clamp<std::chrono::steady_clock::duration> (
+      this->period, dxp_min_screenshot_period, dxp_max_screenshot_period);
+}
+
+/**
+ * Read the first line of a sysfs attribute
+ */
+static std::string
+read_attribute (const std::filesystem::path &path)
+{
+  std::string value;
+  std::ifstream file (path);
+  std::getline (file, value);
+  return value;
+}
+
+/**
+ * Check sysfs power supplies if the machine is running on battery.
+ *
+ * Machine is on battery if some battery discharges and no mains adapter
+ * is online. Desktops without power supply information are never on
+ * battery.
+ */
+bool
+dxp_scheduler::on_battery ()
+{
+  std::error_code ec;
+  bool discharging = false;
+
+  for (const auto &supply : std::filesystem::directory_iterator (
+           "/sys/class/power_supply", ec))
+    {
+      auto type = read_attribute (supply.path () / "type");
+      if (type == "Mains" && read_attribute (supply.path () / "online") == "1")
+        {
+          return false;
+        }
+      if (type == "Battery"
+          && read_attribute (supply.path () / "status") == "Discharging")
+        {
+          discharging = true;
+        }
+    }
+
+  return discharging;
+}
+
+/**
+ * CPU time of the calling thread
+ */
+std::chrono::duration<double>
+dxp_scheduler::thread_cpu_time ()
+{
+  timespec now{};
+  clock_gettime (CLOCK_THREAD_CPUTIME_ID, &now);
+  return std::chrono::seconds (now.tv_sec)
+         + std::chrono::nanoseconds (now.tv_nsec);
+}
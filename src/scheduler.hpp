@@ -0,0 +1,71 @@
+#ifndef DXP_SCHEDULER_HPP
+#define DXP_SCHEDULER_HPP
+
+#include <chrono> // for duration, steady_clock
+#include <mutex>  // for mutex
+
+/**
+ * Picks refresh period that keeps captures within the CPU budget.
+ *
+ * Cost of a capture is the CPU time spent by its tasks plus the time they
+ * wait for the X server, which grows when the server is busy. Both are
+ * smoothed over several captures.
+ */
+class dxp_scheduler
+{
+public:
+  std::chrono::duration<double> cost{ 0 };    ///< CPU time of a capture
+  std::chrono::duration<double> latency{ 0 }; ///< Wait for the X server
+
+  /**
+   * Clocks of a task of the capture when it started, read on the thread
+   * that runs it
+   */
+  struct task
+  {
+    std::chrono::steady_clock::time_point wall
+        = std::chrono::steady_clock::now ();
+    std::chrono::duration<double> cpu = thread_cpu_time ();
+  };
+
+  /**
+   * Start measuring a capture
+   */
+  void start ();
+
+  /**
+   * Add a task that captured something and just finished on the calling
+   * thread. Can be called from several threads at once
+   */
+  void add (const task &t);
+
+  /**
+   * Finish measuring the capture and get time until the next one.
+   * Captured is false if nothing had to be captured
+   */
+  std::chrono::steady_clock::duration finish (bool captured);
+
+  /**
+   * Check sysfs power supplies if the machine is running on battery
+   */
+  static bool on_battery ();
+
+  /**
+   * CPU time of the calling thread
+   */
+  static std::chrono::duration<double> thread_cpu_time ();
+
+private:
+  std::mutex lock; ///< Guards measurements of the tasks
+  /// CPU time of the tasks of the current capture
+  std::chrono::duration<double> task_cpu{ 0 };
+  /// Longest wait of a task of the current capture. Tasks wait at once
+  std::chrono::duration<double> task_wait{ 0 };
+  /// Period picked after the last capture that captured something
+  std::chrono::steady_clock::duration period{ 0 };
+  bool battery = false;       ///< Last result of on_battery
+  /// When power supplies have to be checked again
+  std::chrono::steady_clock::time_point next_battery_check;
+};
+
+#endif /* ifndef DXP_SCHEDULER_HPP */
@@ -0,0 +1,92 @@
+#include "shm.hpp"
+#include "xcb_util.hpp" // for check, xcb_unique_ptr
+#include <cstdlib>      // for free
+#include <sys/ipc.h>    // for IPC_PRIVATE, IPC_CREAT, IPC_RMID
+#include <sys/shm.h>    // for shmget, shmat, shmdt, shmctl
+
+dxp_shm::dxp_shm (xcb_connection_t *c, size_t size)
+{
+  this->c = c;
+  this->size = size;
+
+  if (!is_available (c))
+    {
+      throw shm_error ("MIT-SHM extension is not supported by the X server");
+    }
+
+  int id = shmget (IPC_PRIVATE, size, IPC_CREAT | 0600);
+  if (id == -1)
+    {
+      throw shm_error ("Failed to create a shared memory segment");
+    }
+
+  auto *addr = shmat (id, nullptr, 0);
+  if (addr == reinterpret_cast<void *> (-1))
+    {
+      shmctl (id, IPC_RMID, nullptr);
+      throw shm_error ("Failed to attach a shared memory segment");
+    }
+  this->data = static_cast<uint8_t *> (addr);
+
+  // Server may be unable to attach segment if it's not on the same machine
+  this->seg = xcb_generate_id (c);
+  auto *e = xcb_request_check (
+      c, xcb_shm_attach_checked (c, this->seg, uint32_t (id), 0));
+
+  // Segment will be destroyed once both we and X server detach from it.
+  // This way it won't leak even if the daemon gets killed
+  shmctl (id, IPC_RMID, nullptr);
+
+  if (e != nullptr)
+    {
+      std::free (e);
+      shmdt (this->data);
+      throw shm_error ("X server could not attach a shared memory segment");
+    }
+}
+
+dxp_shm::~dxp_shm ()
+{
+  xcb_shm_detach (this->c, this->seg);
+  xcb_flush (this->c);
+  shmdt (this->data);
+}
+
+/**
+ * Check if the server supports MIT-SHM
+ */
+bool
+dxp_shm::is_available (xcb_connection_t *c)
+{
+  const auto *ext = xcb_get_extension_data (c, &xcb_shm_id);
+  if (ext == nullptr || !ext->present)
+    {
+      return false;
+    }
+
+  xcb_generic_error_t *e = nullptr;
+  auto version = xcb_unique_ptr<xcb_shm_query_version_reply_t> (
+      xcb_shm_query_version_reply (c, xcb_shm_query_version (c), &e));
+  std::free (e);
+
+  return version != nullptr;
+}
+
+/**
+ * Write Z_PIXMAP image of the drawable area to the start of the segment
+ */
+void
+dxp_shm::get_image (xcb_drawable_t drawable, int16_t x, int16_t y,
+                    uint16_t width, uint16_t height)
+{
+  xcb_generic_error_t *e = nullptr;
+  auto cookie = xcb_shm_get_image (this->c, drawable, x, y, width, height,
+                                   uint32_t (~0), /* Plane mask (all planes) */
+                                   XCB_IMAGE_FORMAT_Z_PIXMAP, this->seg,
+                                   0 /* Offset inside of the segment */);
+
+  // Reply only holds image metadata, pixels are already in this->data
+  auto reply = xcb_unique_ptr<xcb_shm_get_image_reply_t> (
+      xcb_shm_get_image_reply (this->c, cookie, &e));
+  check (e, "XCB error while getting shared memory image reply");
+}
@@ -0,0 +1,65 @@
+#ifndef DXP_SHM_HPP
+#define DXP_SHM_HPP
+
+#include <cstddef>      // for size_t
+#include <cstdint>      // for uint8_t, int16_t, uint16_t
+#include <stdexcept>    // for runtime_error
+#include <string>       // for string
+#include <xcb/shm.h>    // for xcb_shm_seg_t
+#include <xcb/xcb.h>    // for xcb_connection_t
+#include <xcb/xproto.h> // for xcb_drawable_t
+
+/**
+ * MIT-SHM segment shared with the X server.
+ *
+ * Images are written by the server straight into this memory instead of
+ * being pushed through the X socket into a freshly allocated reply.
+ */
+class dxp_shm
+{
+public:
+  xcb_shm_seg_t seg; ///< Segment id on the X server side
+  uint8_t *data;     ///< Attached memory. Valid until destruction
+  size_t size;       ///< Size of the segment in bytes
+
+  /**
+   * Create a segment of `size` bytes and attach it to the X server.
+   *
+   * Throws shm_error if the extension is missing or the server can't attach
+   * the segment (e.g. it is running on another machine).
+   */
+  dxp_shm (xcb_connection_t *c, size_t size);
+  ~dxp_shm ();
+
+  // Segment is owned by exactly one object
+  dxp_shm (const dxp_shm &other) = delete;
+  dxp_shm (dxp_shm &&other) noexcept = delete;
+  dxp_shm &operator= (const dxp_shm &other) = delete;
+  dxp_shm &operator= (dxp_shm &&other) = delete;
+
+  /**
+   * Check if the server supports MIT-SHM
+   */
+  static bool is_available (xcb_connection_t *c);
+
+  /**
+   * Write Z_PIXMAP image of the drawable area to the start of the segment.
+   *
+   * Throws xcb_error if the server refused the request.
+   */
+  void get_image (xcb_drawable_t drawable, int16_t x, int16_t y,
+                  uint16_t width, uint16_t height);
+
+private:
+  xcb_connection_t *c; ///< Connection the segment is attached to
+};
+
+class shm_error : public std::runtime_error
+{
+public:
+  shm_error ()
+      : std::runtime_error ("Got an error while creating a shared segment"){};
+  explicit shm_error (const std::string &msg) : std::runtime_error (msg){};
+};
+
+#endif /* ifndef DXP_SHM_HPP */
@@ -1,12 +1,19 @@
 #include "socket.hpp"
-#include <cstddef>      // for offsetof
-#include <cstdio>       // for perror
-#include <cstring>      // for size_t, strlen, strncpy
-#include <mutex>        // for mutex, scoped_lock
-#include <sys/socket.h> // for accept4, bind, connect, listen, socket, AF_UNIX
-#include <sys/un.h>     // for sockaddr_un
-#include <type_traits>  // for is_base_of
-#include <unistd.h>     // for ssize_t, close, unlink, read, write
+#include "config.hpp"    // for dxp_refresh_deadline, dxp_client_timeout
+#include <algorithm>     // for sort, min
+#include <cstddef>       // for offsetof
+#include <cstdio>        // for perror
+#include <cstring>       // for size_t, strlen, strncpy
+#include <fcntl.h>       // for fcntl, F_SETFL, O_NONBLOCK
+#include <memory>        // for shared_ptr, make_shared
+#include <mutex>         // for mutex, scoped_lock, unique_lock
+#include <utility>       // for move
+#include <sys/eventfd.h> // for eventfd, eventfd_read, eventfd_write
+#include <sys/socket.h>  // for accept4, bind, connect, listen, setsockopt
+#include <sys/time.h>    // for timeval
+#include <sys/un.h>      // for sockaddr_un
+#include <type_traits>   // for is_base_of
+#include <unistd.h>      // for ssize_t, close, unlink, read, write
 
 /**
  * Thrower for custom errors.
@@ -48,8 +55,14 @@ read_unix (int fd, D *dest, size_t length, const std::string &error_msg)
       rcv = read (fd, dest + received, length - received);
       is<read_error> (rcv, error_msg);
 
+      // Other side closed the connection before sending everything
+      if (rcv == 0)
+        {
+          throw read_error (error_msg);
+        }
+
       // Increment the received amount with the number of bytes just received
-      received += rcv;
+      received += size_t (rcv);
     }
 }
 
@@ -73,10 +86,94 @@ write_unix (int fd, D *src, size_t length, const std::string &error_msg)
       is<write_error> (wr, error_msg);
 
       // Increment the sent amount with the number of bytes just transferred
-      sent += wr;
+      sent += size_t (wr);
     }
 }
 
+/**
+ * Send desktop data followed by its raw pixmap.
+ *
+ * Smallest level is sent if the desktop has fewer levels.
+ */
+static void
+send_desktop (int fd, const dxp_socket_desktop &desktop, uint8_t level)
+{
+  const auto &p = level == 0 || desktop.mips.empty ()
+                      ? desktop
+                      : desktop.mips[std::min (size_t (level),
+                                               desktop.mips.size ())
+                                     - 1];
+
+  // Sending everything except raw pixmap
+  write_unix (fd, &p, offsetof (dxp_socket_desktop, pixmap),
+              "Failed to send desktop data to dxp");
+
+  // Sending pixmap
+  write_unix (fd, p.pixmap.data (), p.pixmap_len,
+              "Failed to send raw desktop pixmap to dxp");
+}
+
+dxp_refresh::dxp_refresh ()
+{
+  // Daemon only polls the descriptor and must never block on it
+  this->fd = eventfd (0, EFD_NONBLOCK | EFD_CLOEXEC);
+  is<socket_error> (this->fd, "Failed to create a refresh eventfd");
+}
+
+dxp_refresh::~dxp_refresh () { close (this->fd); }
+
+/**
+ * Ask the daemon for a capture and get a ticket to wait for
+ */
+uint64_t
+dxp_refresh::request ()
+{
+  std::scoped_lock<std::mutex> guard (this->lock);
+  eventfd_write (this->fd, 1);
+  return ++this->requested;
+}
+
+/**
+ * Wait until the ticket is completed or the deadline passes.
+ *
+ * Returns false if the deadline passed.
+ */
+bool
+dxp_refresh::wait (uint64_t ticket,
+                   std::chrono::steady_clock::time_point deadline)
+{
+  std::unique_lock<std::mutex> guard (this->lock);
+  return this->completed_cv.wait_until (
+      guard, deadline, [&] { return this->completed >= ticket; });
+}
+
+/**
+ * Take pending requests. Returns ticket of the last one
+ */
+uint64_t
+dxp_refresh::take ()
+{
+  std::scoped_lock<std::mutex> guard (this->lock);
+
+  // Resets the counter. Fails harmlessly if nothing was requested
+  eventfd_t value = 0;
+  eventfd_read (this->fd, &value);
+  return this->requested;
+}
+
+/**
+ * Mark requests up to the ticket as completed
+ */
+void
+dxp_refresh::complete (uint64_t ticket)
+{
+  {
+    std::scoped_lock<std::mutex> guard (this->lock);
+    this->completed = std::max (this->completed, ticket);
+  }
+  this->completed_cv.notify_all ();
+}
+
 /**
  * Connect to socket.
  *
@@ -123,20 +220,56 @@ dxp_socket::dxp_socket ()
       s = bind (this->fd, sock_addr, sizeof (sock_name)); // Bind name to fd
       s = listen (this->fd, 2);                           /* 2 is arbitrary */
       is<bind_error> (s, "Failed to bind a name to the socket");
+
+      // Daemon accepts clients from its event loop, which must never block.
+      // Accepted sockets stay blocking
+      fcntl (this->fd, F_SETFL, O_NONBLOCK);
     }
 };
 
 dxp_socket::~dxp_socket () { close (this->fd); };
 
 /**
- * Request and receive socket_pixmaps from daemon
+ * Take a pending connection. Returns -1 if there is none.
+ *
+ * Reads and writes of the accepted socket fail after dxp_client_timeout
+ * without progress, so a stuck client can't block the server.
+ */
+int
+dxp_socket::accept () const
+{
+  // SOCK_CLOEXEC is because of https://stackoverflow.com/questions/22304631
+  const int data_fd = accept4 (this->fd, nullptr, nullptr, SOCK_CLOEXEC);
+  if (data_fd == -1)
+    {
+      return -1;
+    }
+
+  const auto us = std::chrono::duration_cast<std::chrono::microseconds> (
+                      dxp_client_timeout)
+                      .count ();
+  timeval timeout{};
+  timeout.tv_sec = us / 1000000;
+  timeout.tv_usec = us % 1000000;
+  setsockopt (data_fd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof (timeout));
+  setsockopt (data_fd, SOL_SOCKET, SO_SNDTIMEO, &timeout, sizeof (timeout));
+
+  return data_fd;
+}
+
+/**
+ * Request and receive socket_pixmaps of the level from daemon.
+ *
+ * Level 0 has the configured size, each next one is half of the previous.
  */
 std::vector<dxp_socket_desktop>
-dxp_socket::get_desktops () const
+dxp_socket::get_desktops (uint8_t level) const
 {
   // Send pixmap request to daemon
-  char cmd = RequestDesktops;
-  write_unix (this->fd, &cmd, 1,
+  const char cmd[] = { level == 0 ? char (RequestDesktops)
+                                  : char (RequestLevel),
+                       char (level) };
+  write_unix (this->fd, cmd, level == 0 ? 1 : 2,
               "Failed to send a desktops request to the daemon. "
               "Please check if the daemon is running");
 
@@ -164,50 +297,109 @@ dxp_socket::get_desktops () const
 
       pixmap_array.push_back (p);
     }
+
+  // Current desktop is sent last, so desktops have to be put back in order
+  std::sort (pixmap_array.begin (), pixmap_array.end (),
+             [] (const auto &a, const auto &b) { return a.id < b.id; });
+
   return pixmap_array; // Compiler is smart so vector won't be copied here
 };
 
 /**
- * Starts an infinite loop that listens for the kRequestDesktops write
- * and sends desktops one by one in return
+ * Desktops published last. Stay valid while the pointer is held
+ */
+std::shared_ptr<const dxp_snapshots::list>
+dxp_snapshots::load () const
+{
+  return this->desktops.load (std::memory_order_acquire);
+}
+
+/**
+ * Replace all desktops
  */
 void
-dxp_socket::send_desktops_on_event (
-    const std::vector<dxp_socket_desktop> &desktops,
-    std::mutex &desktops_lock) const
+dxp_snapshots::publish (list desktops)
 {
-  int data_fd = 0; // Socket file descriptor
+  this->desktops.store (std::make_shared<const list> (std::move (desktops)),
+                        std::memory_order_release);
+}
 
-  // SOCK_CLOEXEC is because of https://stackoverflow.com/questions/22304631
-  while ((data_fd = accept4 (this->fd, nullptr, nullptr, SOCK_CLOEXEC))
-         && this->running)
+/**
+ * Replace desktop with the id. Only one thread may publish.
+ *
+ * Other desktops are shared with the previous list, so only pointers are
+ * copied.
+ */
+void
+dxp_snapshots::publish (uint id, dxp_socket_desktop desktop)
+{
+  auto desktops = *this->load ();
+  if (id < desktops.size ())
     {
-      // Check the incoming command
-      char cmd = -1;
-      read_unix (data_fd, &cmd, 1, "Failed to get a command from dxp");
+      desktops[id]
+          = std::make_shared<const dxp_socket_desktop> (std::move (desktop));
+      publish (std::move (desktops));
+    }
+}
 
-      if (cmd == RequestDesktops)
+/**
+ * Serve a client connected to the socket. kRequestDesktops is answered
+ * with desktops sent one by one. kRequestLevel is followed by the level of
+ * the pixmaps to send.
+ *
+ * Current desktop is recaptured while the others are being sent and is
+ * sent last. If the capture misses dxp_refresh_deadline, its cached
+ * screenshot is sent instead.
+ */
+void
+dxp_socket::serve (int data_fd, const dxp_snapshots &desktops,
+                   dxp_refresh &refresh) const
+{
+  // Check the incoming command
+  char cmd = -1;
+  read_unix (data_fd, &cmd, 1, "Failed to get a command from dxp");
+
+  uint8_t level = 0;
+  if (cmd == RequestLevel)
+    {
+      read_unix (data_fd, &level, 1, "Failed to get a level from dxp");
+    }
+
+  if (cmd != RequestDesktops && cmd != RequestLevel)
+    {
+      return;
+    }
+
+  auto deadline = std::chrono::steady_clock::now () + dxp_refresh_deadline;
+  auto ticket = refresh.request ();
+  uint current = refresh.current;
+
+  // Daemon may publish new desktops while these are being sent
+  const auto cached = desktops.load ();
+
+  // First write -- number of desktops to be sent
+  size_t num = cached->size ();
+  write_unix (data_fd, &num, sizeof (num),
+              "Failed to send number of desktops to dxp");
+
+  // Sending cached desktops while the current one is captured
+  for (const auto &p : *cached)
+    {
+      if (p->id != current)
         {
-          // Lock desktops to prevent race condition when reading and writing
-          // desktops to socket
-          std::scoped_lock<std::mutex> guard (desktops_lock);
-
-          // First write -- number of desktops to be sent
-          size_t num = desktops.size ();
-          write_unix (data_fd, &num, sizeof (num),
-                      "Failed to send number of desktops to dxp");
-
-          // Writes from second to `num+1` * 2 -- sending desktops
-          for (const auto &p : desktops)
-            {
-              // Sending everything except raw pixmap
-              write_unix (data_fd, &p, offsetof (dxp_socket_desktop, pixmap),
-                          "Failed to send desktop data to dxp");
-
-              // Sending pixmap
-              write_unix (data_fd, p.pixmap.data (), p.pixmap_len,
-                          "Failed to send raw desktop pixmap to dxp");
-            }
+          send_desktop (data_fd, *p, level);
         }
     }
-};
+
+  // Cached screenshot is used if the capture is late
+  refresh.wait (ticket, deadline);
+
+  if (current < cached->size ())
+    {
+      const auto fresh = desktops.load ();
+      send_desktop (data_fd,
+                    current < fresh->size () ? *(*fresh)[current]
+                                             : *(*cached)[current],
+                    level);
+    }
+}
@@ -1,13 +1,16 @@
 #ifndef DEXPO_SOCKET_HPP
 #define DEXPO_SOCKET_HPP
 
-#include <atomic>      // for atomic
-#include <cstdint>     // for uint8_t, uint16_t, uint32_t
-#include <mutex>       // for mutex
-#include <stdexcept>   // for runtime_error
-#include <string>      // for string
-#include <sys/types.h> // for uint
-#include <vector>      // for vector
+#include <atomic>             // for atomic
+#include <chrono>             // for steady_clock
+#include <condition_variable> // for condition_variable
+#include <cstdint>            // for uint8_t, uint16_t, uint32_t, uint64_t
+#include <memory>             // for shared_ptr, make_shared
+#include <mutex>              // for mutex
+#include <stdexcept>          // for runtime_error
+#include <string>             // for string
+#include <sys/types.h>        // for uint
+#include <vector>             // for vector
 
 constexpr const char *k_socket_path = "/tmp/dxp.socket";
 
@@ -22,6 +25,44 @@ struct dxp_socket_desktop
   uint16_t height;
   uint32_t pixmap_len;
   std::vector<uint8_t> pixmap; ///< Pixmap in RBGA format
+  /// Smaller levels of the pixmap, each half the size of the previous one.
+  /// Kept by the daemon only, a desktop is sent with a single level
+  std::vector<dxp_socket_desktop> mips;
+};
+
+/**
+ * Desktops shared with the socket server.
+ *
+ * Published desktops are immutable. Daemon builds a new desktop from its
+ * own pixmaps and swaps it into a new list, server pins the list it loaded
+ * for as long as it sends it. Neither of them waits for the other to finish
+ * a capture or a transfer.
+ */
+class dxp_snapshots
+{
+public:
+  using list = std::vector<std::shared_ptr<const dxp_socket_desktop>>;
+
+  /**
+   * Desktops published last. Stay valid while the pointer is held
+   */
+  [[nodiscard]] std::shared_ptr<const list> load () const;
+
+  /**
+   * Replace all desktops
+   */
+  void publish (list desktops);
+
+  /**
+   * Replace desktop with the id. Only one thread may publish
+   */
+  void publish (uint id, dxp_socket_desktop desktop);
+
+private:
+  /// Replaced as a whole, so readers never see a half updated list
+  std::atomic<std::shared_ptr<const list>> desktops{
+    std::make_shared<list> ()
+  };
 };
 
 /**
@@ -29,14 +70,65 @@ struct dxp_socket_desktop
  */
 enum dxp_event
 {
-  RequestDesktops = 1 // Request all pixmaps
+  RequestDesktops = 1, // Request all pixmaps
+  RequestLevel = 2     // Request all pixmaps of the level in the next byte
+};
+
+/**
+ * Fresh captures requested by the socket server.
+ *
+ * Server thread requests a capture, which wakes the daemon through an
+ * eventfd. Daemon takes all pending requests, captures visible desktops
+ * and completes the requests.
+ */
+class dxp_refresh
+{
+public:
+  int fd;                      ///< Readable while requests are pending
+  std::atomic<uint> current{}; ///< Id of the current desktop
+
+  dxp_refresh ();
+  ~dxp_refresh ();
+
+  // Explicitly delete unused constructors to comply with the rule of five
+  dxp_refresh (const dxp_refresh &other) = delete;
+  dxp_refresh (dxp_refresh &&other) noexcept = delete;
+  dxp_refresh &operator= (const dxp_refresh &other) = delete;
+  dxp_refresh &operator= (dxp_refresh &&other) = delete;
+
+  /**
+   * Ask the daemon for a capture and get a ticket to wait for
+   */
+  uint64_t request ();
+
+  /**
+   * Wait until the ticket is completed or the deadline passes.
+   *
+   * Returns false if the deadline passed.
+   */
+  bool wait (uint64_t ticket, std::chrono::steady_clock::time_point deadline);
+
+  /**
+   * Take pending requests. Returns ticket of the last one
+   */
+  uint64_t take ();
+
+  /**
+   * Mark requests up to the ticket as completed
+   */
+  void complete (uint64_t ticket);
+
+private:
+  std::mutex lock;
+  std::condition_variable completed_cv;
+  uint64_t requested = 0; ///< Ticket of the last request
+  uint64_t completed = 0; ///< Ticket of the last completed request
 };
 
 class dxp_socket
 {
 public:
-  int fd;                            ///< Socket File Descriptor
-  std::atomic<bool> running{ true }; ///< Thread status. Used to kill while loop
+  int fd; ///< Socket File Descriptor
 
   dxp_socket ();
   ~dxp_socket ();
@@ -47,9 +139,21 @@ public:
   dxp_socket &operator= (const dxp_socket &other) = delete;
   dxp_socket &operator= (dxp_socket &&other) = delete;
 
-  [[nodiscard]] std::vector<dxp_socket_desktop> get_desktops () const;
-  void send_desktops_on_event (const std::vector<dxp_socket_desktop> &,
-                               std::mutex &desktops_lock) const;
+  [[nodiscard]] std::vector<dxp_socket_desktop>
+  get_desktops (uint8_t level = 0) const;
+
+  /**
+   * Take a pending connection. Returns -1 if there is none.
+   * Reads and writes of the connection time out after dxp_client_timeout
+   */
+  [[nodiscard]] int accept () const;
+
+  /**
+   * Serve a client connected to the socket. Blocks until the current
+   * desktop is captured or the refresh deadline passes
+   */
+  void serve (int data_fd, const dxp_snapshots &desktops,
+              dxp_refresh &refresh) const;
   void server () const;
 };
 
@@ -0,0 +1,252 @@
+#include "tune.hpp"
+#include "desktop.hpp"  // for dxp_desktop
+#include "pool.hpp"     // for dxp_pool
+#include <algorithm>    // for min, max
+#include <chrono>       // for steady_clock, duration
+#include <cstddef>      // for size_t
+#include <cstdint>      // for uint8_t, uint32_t
+#include <cstdlib>      // for getenv
+#include <filesystem>   // for path, create_directories
+#include <fstream>      // for ifstream, ofstream
+#include <iostream>     // for operator<<, endl, basic_ostream, cerr
+#include <sstream>      // for istringstream
+#include <system_error> // for error_code
+#include <thread>       // for thread
+
+/// Each candidate is measured this many times and the fastest run counts
+constexpr int k_tune_runs = 2;
+
+/// Tile sizes tried with the blur filter. 0 is a column block per thread
+constexpr std::array<uint, 4> k_tune_tile_bytes
+    = { 64 * 1024, 256 * 1024, 1024 * 1024, 0 };
+
+/// Names of resize_filter values for the report
+constexpr std::array<const char *, 6> k_filter_names
+    = { "area", "blur", "bilinear", "bicubic", "lanczos2", "lanczos3" };
+
+/**
+ * Settings used by the image kernels
+ */
+dxp_tuning &
+dxp_tuning::current ()
+{
+  static dxp_tuning tuning;
+  return tuning;
+}
+
+/**
+ * Model name of the first CPU from /proc/cpuinfo
+ */
+static std::string
+cpu_model ()
+{
+  std::ifstream cpuinfo ("/proc/cpuinfo");
+  std::string line;
+  while (std::getline (cpuinfo, line))
+    {
+      if (line.rfind ("model name", 0) == 0)
+        {
+          return line.substr (line.find (':') + 2);
+        }
+    }
+  return "unknown";
+}
+
+/**
+ * File with the cached choices. Empty if there is no home directory
+ */
+static std::filesystem::path
+cache_path ()
+{
+  const char *cache = std::getenv ("XDG_CACHE_HOME");
+  if (cache && *cache)
+    {
+      return std::filesystem::path (cache) / "dxp" / "autotune";
+    }
+  const char *home = std::getenv ("HOME");
+  if (home && *home)
+    {
+      return std::filesystem::path (home) / ".cache" / "dxp" / "autotune";
+    }
+  return {};
+}
+
+/**
+ * Pick the fastest settings for desktops of the sizes and make them
+ * current. Sizes are width, height of the desktop and of its pixmap.
+ *
+ * Every allowed filter is tried with thread counts that are powers of two
+ * up to the number of cores, the blur filter with each tile size too.
+ */
+void
+dxp_tuning::autotune (const std::vector<std::array<uint, 4>> &sizes)
+{
+  // Choice depends on the CPU, the sizes and the allowed filters
+  std::string key = cpu_model ();
+  for (const auto &[width, height, pixmap_width, pixmap_height] : sizes)
+    {
+      key += " " + std::to_string (width) + "x" + std::to_string (height)
+             + ":" + std::to_string (pixmap_width) + "x"
+             + std::to_string (pixmap_height);
+    }
+  for (auto filter : dxp_autotune_filters)
+    {
+      key += " " + std::string (k_filter_names[size_t (filter)]);
+    }
+
+  auto &tuning = current ();
+  if (tuning.load (key))
+    {
+      std::cerr << "Using cached settings: ";
+    }
+  else
+    {
+      const uint cores = std::max (std::thread::hardware_concurrency (), 1U);
+      std::vector<uint> thread_counts;
+      for (uint threads = 1; threads < cores; threads *= 2)
+        {
+          thread_counts.push_back (threads);
+        }
+      thread_counts.push_back (cores);
+
+      double best = 0;
+      for (auto filter : dxp_autotune_filters)
+        {
+          for (auto threads : thread_counts)
+            {
+              for (auto tile_bytes : k_tune_tile_bytes)
+                {
+                  // Only the blur filter is tiled
+                  if (filter != resize_filter::blur
+                      && tile_bytes != k_tune_tile_bytes[0])
+                    {
+                      continue;
+                    }
+
+                  dxp_tuning candidate{ filter, tile_bytes, threads };
+                  const double cost = candidate.measure (sizes);
+                  if (best == 0 || cost < best)
+                    {
+                      best = cost;
+                      tuning = candidate;
+                    }
+                }
+            }
+        }
+
+      tuning.save (key);
+      std::cerr << "Measured the fastest settings: ";
+    }
+
+  std::cerr << k_filter_names[size_t (tuning.filter)] << " filter, ";
+  if (tuning.filter == resize_filter::blur && tuning.tile_bytes == 0)
+    {
+      std::cerr << "a column block per thread, ";
+    }
+  else if (tuning.filter == resize_filter::blur)
+    {
+      std::cerr << tuning.tile_bytes << " byte tiles, ";
+    }
+  std::cerr << tuning.threads << " threads" << std::endl;
+}
+
+/**
+ * Time of processing a frame of each size with the settings in seconds.
+ *
+ * Frames are processed by desktops of the sizes, exactly as captured
+ * screenshots are, but on a pool with the candidate number of threads.
+ */
+double
+dxp_tuning::measure (const std::vector<std::array<uint, 4>> &sizes) const
+{
+  dxp_pool pool (this->threads);
+
+  double total = 0;
+  for (const auto &size : sizes)
+    {
+      // Filters are computed once per desktop, so they aren't measured
+      dxp_desktop desktop (size[0], size[1], *this, pool);
+
+      // Gradients with some noise, so nothing is skipped or cached
+      std::vector<uint32_t> frame (size_t (desktop.width) * desktop.height);
+      for (size_t i = 0; i < frame.size (); i++)
+        {
+          frame[i] = uint32_t (i * 2654435761U) & 0x00FFFFFF;
+        }
+      desktop.image_ptr = reinterpret_cast<uint8_t *> (frame.data ());
+
+      double fastest = 0;
+      for (int run = 0; run < k_tune_runs; run++)
+        {
+          const auto start = std::chrono::steady_clock::now ();
+
+          desktop.save_sources (0, int (desktop.pixmap_width), 0,
+                                int (desktop.pixmap_height), 0, 0,
+                                int (desktop.width) * 4);
+
+          const std::chrono::duration<double> elapsed
+              = std::chrono::steady_clock::now () - start;
+          fastest = run == 0 ? elapsed.count ()
+                             : std::min (fastest, elapsed.count ());
+        }
+
+      total += fastest;
+    }
+
+  return total;
+}
+
+/**
+ * Read the cached choice for the key. Returns false if there is none.
+ *
+ * Lines of the cache are the key followed by a tab, filter, tile size and
+ * thread count.
+ */
+bool
+dxp_tuning::load (const std::string &key)
+{
+  std::ifstream cache (cache_path ());
+  std::string line;
+  while (std::getline (cache, line))
+    {
+      const auto tab = line.rfind ('\t');
+      if (tab == std::string::npos || line.substr (0, tab) != key)
+        {
+          continue;
+        }
+
+      std::istringstream values (line.substr (tab + 1));
+      uint filter = 0;
+      uint tile_bytes = 0;
+      uint threads = 0;
+      if (values >> filter >> tile_bytes >> threads
+          && filter < k_filter_names.size () && threads > 0)
+        {
+          this->filter = resize_filter (filter);
+          this->tile_bytes = tile_bytes;
+          this->threads = threads;
+          return true;
+        }
+    }
+  return false;
+}
+
+/**
+ * Append the choice for the key to the cache
+ */
+void
+dxp_tuning::save (const std::string &key) const
+{
+  const auto path = cache_path ();
+  if (path.empty ())
+    {
+      return;
+    }
+
+  // Choice is measured again next time if the cache can't be written
+  std::error_code e;
+  std::filesystem::create_directories (path.parent_path (), e);
+  std::ofstream cache (path, std::ios::app);
+  cache << key << '\t' << uint (this->filter) << ' ' << this->tile_bytes << ' '
+        << this->threads << '\n';
+}
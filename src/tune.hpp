@@ -0,0 +1,55 @@
+#ifndef DXP_TUNE_HPP
+#define DXP_TUNE_HPP
+
+#include "config.hpp"  // for resize_filter, dxp_resize_filter, dxp_threads
+#include <array>       // for array
+#include <string>      // for string
+#include <sys/types.h> // for uint
+#include <vector>      // for vector
+
+/**
+ * Settings of the image kernels that are picked at startup.
+ *
+ * Defaults come from the config. With dxp_autotune, candidates are measured
+ * on synthetic frames of the desktop sizes and the fastest one is used.
+ * Choices are cached on disk by CPU model and desktop sizes.
+ */
+class dxp_tuning
+{
+public:
+  resize_filter filter = dxp_resize_filter;
+  uint tile_bytes = dxp_tile_bytes; ///< Tile size of the blur filter
+  uint threads = dxp_threads;       ///< Size of the shared pool
+
+  /**
+   * Settings used by the image kernels
+   */
+  static dxp_tuning &current ();
+
+  /**
+   * Pick the fastest settings for desktops of the sizes and make them
+   * current. Sizes are width, height of the desktop and of its pixmap.
+   *
+   * Has to be called before the shared pool is used.
+   */
+  static void autotune (const std::vector<std::array<uint, 4>> &sizes);
+
+private:
+  /**
+   * Time of processing a frame of each size with the settings in seconds
+   */
+  [[nodiscard]] double
+  measure (const std::vector<std::array<uint, 4>> &sizes) const;
+
+  /**
+   * Read the cached choice for the key. Returns false if there is none
+   */
+  bool load (const std::string &key);
+
+  /**
+   * Append the choice for the key to the cache
+   */
+  void save (const std::string &key) const;
+};
+
+#endif /* ifndef DXP_TUNE_HPP */
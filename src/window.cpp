@@ -332,20 +332,20 @@ window::draw_desktop_border (uint desktop_id, uint32_t color)
         int16_t (x - border),          /* x */
         int16_t (y - border),          /* y */
         uint16_t (width + 2 * border), /* width */
-        uint16_t (border)              /* height */
+        border                         /* height */
     },
     // Left border
     xcb_rectangle_t{
         int16_t (x - border),          /* x */
         int16_t (y - border),          /* y */
-        uint16_t (border),             /* width */
+        border,                        /* width */
         uint16_t (height + 2 * border) /* height */
     },
     // Right border
     xcb_rectangle_t{
         int16_t (x + width),           /* x */
         int16_t (y - border),          /* y */
-        uint16_t (border),             /* width */
+        border,                        /* width */
         uint16_t (height + 2 * border) /* height */
     },
     // Bottom border
@@ -353,7 +353,7 @@ window::draw_desktop_border (uint desktop_id, uint32_t color)
         int16_t (x - border),          /* x */
         int16_t (y + height),          /* y */
         uint16_t (width + 2 * border), /* width */
-        uint16_t (border)              /* height */
+        border                         /* height */
     }
   };
 
@@ -18,13 +18,10 @@ check (xcb_generic_error_t *e, const std::string &msg)
 };
 
 /**
- * Get a vector with EWMH property values
- *
- * @note vector size is inconsistent so vector may contain other data
+ * Get atom by its name
  */
-std::vector<uint32_t>
-get_property_value (xcb_connection_t *c, xcb_window_t root,
-                    const char *atom_name)
+xcb_atom_t
+get_atom (xcb_connection_t *c, const char *atom_name)
 {
   xcb_generic_error_t *e = nullptr; // TODO(mmskv): Check for memory leak
 
@@ -33,10 +30,23 @@ get_property_value (xcb_connection_t *c, xcb_window_t root,
       xcb_intern_atom_reply (c, atom_cookie, &e));
   check (e, "XCB error while getting atom reply");
 
-  auto atom = atom_reply
-                  ? atom_reply->atom
-                  : throw std::runtime_error (
-                      std::string ("Could not get atom for ") + atom_name);
+  return atom_reply ? atom_reply->atom
+                    : throw std::runtime_error (
+                        std::string ("Could not get atom for ") + atom_name);
+}
+
+/**
+ * Get a vector with EWMH property values
+ *
+ * @note vector size is inconsistent so vector may contain other data
+ */
+std::vector<uint32_t>
+get_property_value (xcb_connection_t *c, xcb_window_t root,
+                    const char *atom_name)
+{
+  xcb_generic_error_t *e = nullptr;
+
+  auto atom = get_atom (c, atom_name);
 
   /* Getting property from atom */
 
@@ -175,14 +185,22 @@ get_desktops (xcb_connection_t *c, xcb_window_t root)
                       // Otherwise parse viewport from EWMH
                       : get_property_value (c, root, "_NET_DESKTOP_VIEWPORT");
 
+  // Window manager may count a new desktop before setting its viewport
+  if (viewport.size () < number_of_desktops * 2)
+    {
+      throw std::runtime_error (
+          "_NET_DESKTOP_VIEWPORT has fewer desktops than "
+          "_NET_NUMBER_OF_DESKTOPS");
+    }
+
   std::vector<desktop_info> info;
 
   // Figuring out width and height of a desktop based on existing
   // monitors and desktop x, y coordinates
   for (uint i = 0; i < number_of_desktops; i++)
     {
-      int x = viewport[i * 2];
-      int y = viewport[i * 2 + 1];
+      int x = int (viewport[i * 2]);
+      int y = int (viewport[i * 2 + 1]);
       uint width = 0;
       uint height = 0;
 
@@ -78,6 +78,11 @@ xcb_unique_ptr (T *ptr)
   return std::unique_ptr<T, decltype (&std::free)> (ptr, &std::free);
 }
 
+/**
+ * Get atom by its name
+ */
+xcb_atom_t get_atom (xcb_connection_t *c, const char *atom_name);
+
 /**
  * Get a vector with EWMH property values
  *
@@ -0,0 +1,129 @@
+#define BOOST_TEST_MODULE Blur Test
+
+#include "../src/blur.hpp"
+#include <boost/test/unit_test.hpp>
+#include <cstdint>
+#include <random>
+#include <vector>
+
+// Desktop and thumbnail widths, from a single monitor to 8K and desktops
+// spanning several 4K monitors downscaled to status bar icons
+const std::vector<std::pair<int, int>> ratios
+    = { { 1920, 266 }, { 3840, 150 }, { 7680, 266 }, { 7680, 32 },
+        { 11520, 32 }, { 15360, 32 }, { 30720, 32 } };
+
+// To generate random images in tests
+std::mt19937 gen (42);
+std::uniform_int_distribution<uint32_t> p_rnd (0, 0xFFFFFF);
+
+std::vector<uint32_t>
+random_line (size_t length)
+{
+  std::vector<uint32_t> line (length);
+  for (auto &p : line)
+    {
+      p = p_rnd (gen);
+    }
+  return line;
+}
+
+/**
+ * Kernel average of a pixel with 64 bit sums
+ */
+uint32_t
+reference (const std::vector<uint32_t> &line, int x, int radius)
+{
+  uint64_t sum[3] = {};
+  for (int i = x - radius; i <= x + radius; i++)
+    {
+      const uint32_t p = line[size_t (i)];
+      for (int c = 0; c < 3; c++)
+        {
+          sum[c] += (p >> (8 * c)) & 0xFF;
+        }
+    }
+
+  const auto n = uint64_t (2 * radius + 1);
+  return uint32_t (sum[2] / n) << 16 | uint32_t (sum[1] / n) << 8
+         | uint32_t (sum[0] / n);
+}
+
+BOOST_AUTO_TEST_CASE (flat_image_stays_flat)
+{
+  for (auto [source, target] : ratios)
+    {
+      const auto radius = uint (source / target / 2);
+      std::vector<uint32_t> line (size_t (source), 0x00FFFFFF);
+
+      box_blur_horizontal ({ line.data (), source, 1 }, radius);
+      for (auto p : line)
+        {
+          BOOST_REQUIRE_EQUAL (p, 0x00FFFFFFU);
+        }
+
+      box_blur_vertical ({ line.data (), 1, source }, radius);
+      for (auto p : line)
+        {
+          BOOST_REQUIRE_EQUAL (p, 0x00FFFFFFU);
+        }
+
+      box_blur_horizontal_scalar ({ line.data (), source, 1 }, radius);
+      box_blur_vertical_scalar ({ line.data (), 1, source }, radius);
+      for (auto p : line)
+        {
+          BOOST_REQUIRE_EQUAL (p, 0x00FFFFFFU);
+        }
+    }
+}
+
+BOOST_AUTO_TEST_CASE (simd_matches_scalar)
+{
+  for (auto [source, target] : ratios)
+    {
+      const auto radius = uint (source / target / 2);
+
+      // Two rows, so both rows of a pair of the AVX2 version are checked
+      auto image = random_line (size_t (2 * source));
+      auto expected = image;
+      box_blur_horizontal ({ image.data (), source, 2 }, radius);
+      box_blur_horizontal_scalar ({ expected.data (), source, 2 }, radius);
+      BOOST_REQUIRE (image == expected);
+
+      // Nine columns fill an AVX2 register and leave a tail
+      image = random_line (size_t (9 * source));
+      expected = image;
+      box_blur_vertical ({ image.data (), 9, source }, radius);
+      box_blur_vertical_scalar ({ expected.data (), 9, source }, radius);
+      BOOST_REQUIRE (image == expected);
+    }
+}
+
+BOOST_AUTO_TEST_CASE (wide_sums_match_reference)
+{
+  for (auto [source, target] : ratios)
+    {
+      const int radius = source / target / 2;
+      const auto original = random_line (size_t (source));
+      auto image = original;
+      box_blur_horizontal ({ image.data (), source, 1 }, uint (radius));
+
+      // Mirrored pixels of the left edge leave in the reverse order and
+      // the right edge adds pixels that are already blurred
+      for (int x = radius; x < source - radius - 1; x++)
+        {
+          BOOST_REQUIRE_EQUAL (image[size_t (x)],
+                               reference (original, x, radius));
+        }
+    }
+}
+
+BOOST_AUTO_TEST_CASE (radius_is_limited_to_the_image)
+{
+  std::vector<uint32_t> image (6 * 3, 0x00804020);
+  box_blur_horizontal ({ image.data (), 6, 3 }, 100);
+  box_blur_vertical ({ image.data (), 6, 3 }, 100);
+  for (auto p : image)
+    {
+      BOOST_REQUIRE_EQUAL (p, 0x00804020U);
+    }
+}
@@ -0,0 +1,103 @@
+#define BOOST_TEST_MODULE Resample Test
+
+#include "../src/resample.hpp"
+#include <boost/test/unit_test.hpp>
+#include <cstdint>
+#include <random>
+#include <vector>
+
+// Desktop and thumbnail widths, from a single monitor to 8K and desktops
+// spanning several 4K monitors downscaled to status bar icons
+const std::vector<std::pair<int, int>> ratios
+    = { { 1920, 266 }, { 3840, 150 }, { 7680, 266 }, { 7680, 32 },
+        { 11520, 32 }, { 15360, 32 }, { 30720, 32 } };
+
+// Every filter of the resampler. Blur is done by the desktop instead
+const std::vector<resize_filter> filters
+    = { resize_filter::area, resize_filter::bilinear, resize_filter::bicubic,
+        resize_filter::lanczos2, resize_filter::lanczos3 };
+
+// To generate random images in tests
+std::mt19937 gen (42);
+std::uniform_int_distribution<uint32_t> p_rnd (0, 0xFFFFFF);
+
+std::vector<uint32_t>
+random_image (size_t length)
+{
+  std::vector<uint32_t> image (length);
+  for (auto &p : image)
+    {
+      p = p_rnd (gen);
+    }
+  return image;
+}
+
+BOOST_AUTO_TEST_CASE (flat_image_stays_flat)
+{
+  for (auto filter : filters)
+    {
+      for (auto [source, target] : ratios)
+        {
+          for (uint32_t colour : { 0x00FFFFFFU, 0x00804020U, 0x00010203U })
+            {
+              const std::vector<uint32_t> line (size_t (source), colour);
+              auto output = std::vector<uint32_t> (size_t (target));
+
+              // Along a row
+              const dxp_resampler row (filter, source, 1, target, 1);
+              row.resample_row ({ line.data (), source, 1 }, 0, 0, 0, 0,
+                                target, output.data ());
+              for (auto p : output)
+                {
+                  BOOST_REQUIRE_EQUAL (p, colour);
+                }
+
+              // Along a column
+              const dxp_resampler column (filter, 1, source, 1, target);
+              for (int y = 0; y < target; y++)
+                {
+                  column.resample_row ({ line.data (), 1, source }, 0, 0, y,
+                                       0, 1, output.data ());
+                  BOOST_REQUIRE_EQUAL (output[0], colour);
+                }
+            }
+        }
+    }
+}
+
+BOOST_AUTO_TEST_CASE (simd_matches_scalar)
+{
+  constexpr int source_height = 64;
+  constexpr int target_height = 5;
+
+  for (auto filter : filters)
+    {
+      for (auto [source, target] : ratios)
+        {
+          const auto image
+              = random_image (size_t (source) * size_t (source_height));
+          const dxp_image_view<const uint32_t> view (image.data (), source,
+                                                     source_height);
+          const dxp_resampler resampler (filter, source, source_height,
+                                         target, target_height);
+
+          auto output = std::vector<uint32_t> (size_t (target));
+          auto expected = std::vector<uint32_t> (size_t (target));
+          for (int y = 0; y < target_height; y++)
+            {
+              resampler.resample_row (view, 0, 0, y, 0, target,
+                                      output.data ());
+              resampler.resample_row_scalar (view, 0, 0, y, 0, target,
+                                             expected.data ());
+              BOOST_REQUIRE (output == expected);
+
+              // Columns of a tile start inside the AVX2 registers
+              resampler.resample_row (view, 0, 0, y, 1, target - 1,
+                                      output.data ());
+              resampler.resample_row_scalar (view, 0, 0, y, 1, target - 1,
+                                             expected.data ());
+              BOOST_REQUIRE (output == expected);
+            }
+        }
+    }
+}
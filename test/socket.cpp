@@ -1,66 +1,120 @@
 #define BOOST_TEST_MODULE Sockets Test
 
-#include "../src/dexpo_socket.hpp"
+#include "../src/socket.hpp"
+#include <algorithm>
 #include <boost/test/unit_test.hpp>
 #include <boost/test/unit_test_log.hpp>
 #include <boost/test/unit_test_suite.hpp>
+#include <chrono>
 #include <future>
-#include <mutex>
+#include <memory>
+#include <poll.h>
 #include <random>
-#include <string>
 #include <thread>
+#include <unistd.h>
+#include <vector>
 
 // For random numbers in tests
-#define MAX_NUM 10000000
-#define SMALL_MAX_NUM 38000
+#define SMALL_MAX_NUM 64
 
-// Overloads for boost::test to compare pixmaps
+// Overloads for boost::test to compare desktops
 bool
-operator== (const dexpo_pixmap d1, const dexpo_pixmap d2)
+operator== (const dxp_socket_desktop &d1, const dxp_socket_desktop &d2)
 {
-  return d1.desktop_number == d2.desktop_number && d1.width == d2.width
-         && d1.height == d2.height && d1.id == d2.id
-         && strcmp (d1.name, d2.name) == 0;
+  return d1.id == d2.id && d1.width == d2.width && d1.height == d2.height
+         && d1.pixmap_len == d2.pixmap_len && d1.pixmap == d2.pixmap;
 };
 
-void
-operator<< (std::ostream &stream, const dexpo_pixmap &d)
+std::ostream &
+operator<< (std::ostream &stream, const dxp_socket_desktop &d)
 {
-  stream << d.name << ", " << d.id << ", " << d.width << ", " << d.height
-         << ", " << d.desktop_number;
+  return stream << d.id << ", " << d.width << ", " << d.height << ", "
+                << d.pixmap_len;
 };
 
 // To generate random numbers in tests
 std::random_device rd;
 std::mt19937 gen (rd ());
-std::uniform_int_distribution<xcb_pixmap_t> m_rnd (0, MAX_NUM);
-std::uniform_int_distribution<uint16_t> s_rnd (0, SMALL_MAX_NUM);
+std::uniform_int_distribution<uint16_t> s_rnd (1, SMALL_MAX_NUM);
+std::uniform_int_distribution<int> p_rnd (0, 255);
+
+/**
+ * Desktop with a random size and pixmap
+ */
+dxp_socket_desktop
+random_desktop (uint id)
+{
+  dxp_socket_desktop d;
+  d.id = id;
+  d.width = s_rnd (gen);
+  d.height = s_rnd (gen);
+  d.pixmap_len = uint32_t (d.width) * d.height * 4;
+  d.pixmap.resize (d.pixmap_len);
+  for (auto &p : d.pixmap)
+    {
+      p = uint8_t (p_rnd (gen));
+    }
+  return d;
+}
+
+/**
+ * Publish the desktops as the daemon does
+ */
+void
+publish (dxp_snapshots &snapshots, const std::vector<dxp_socket_desktop> &v)
+{
+  dxp_snapshots::list desktops;
+  for (const auto &d : v)
+    {
+      desktops.push_back (std::make_shared<const dxp_socket_desktop> (d));
+    }
+  snapshots.publish (std::move (desktops));
+}
+
+/**
+ * Accept the client connected to the server and serve it on a new thread
+ */
+std::thread
+serve_client (const dxp_socket &server, const dxp_snapshots &snapshots,
+              dxp_refresh &refresh)
+{
+  pollfd pfd{ server.fd, POLLIN, 0 };
+  poll (&pfd, 1, 1000);
+  const int fd = server.accept ();
+  BOOST_REQUIRE (fd != -1);
+
+  return std::thread ([&, fd] {
+    server.serve (fd, snapshots, refresh);
+    close (fd);
+  });
+}
 
 BOOST_AUTO_TEST_CASE (send_vecotrs)
 {
   // Initialize test desktop structs
-  dexpo_pixmap d0{ 0, s_rnd (gen), s_rnd (gen), m_rnd (gen), "HDMI-0" };
-  dexpo_pixmap d1{ 1, s_rnd (gen), s_rnd (gen), m_rnd (gen), "VDI-1" };
-  dexpo_pixmap d2{ 2, s_rnd (gen), s_rnd (gen), m_rnd (gen), "DP-0" };
-  dexpo_pixmap d3{ 3, s_rnd (gen), s_rnd (gen), m_rnd (gen), "VGA-1" };
-
-  std::vector<dexpo_pixmap> v = { d0, d1, d2, d3 };
-  std::mutex v_lock;
-
-  auto daemon = dexpo_socket ();
-  std::thread daemon_thread (&dexpo_socket::send_pixmaps_on_event, &daemon,
-                             std::ref (v), std::ref (v_lock));
-  daemon_thread.detach ();
-  BOOST_TEST_MESSAGE ("Started thread");
+  std::vector<dxp_socket_desktop> v
+      = { random_desktop (0), random_desktop (1), random_desktop (2),
+          random_desktop (3) };
+
+  dxp_snapshots snapshots;
+  publish (snapshots, v);
+  dxp_refresh refresh;
+  refresh.current = 1;
 
-  auto client = dexpo_socket ();
+  auto daemon = dxp_socket ();
+  auto client = dxp_socket ();
   BOOST_TEST_MESSAGE ("Created client");
 
-  auto v_recv = client.get_pixmaps ();
-  BOOST_TEST_MESSAGE ("Got pixmaps");
+  // Nobody captures, so the cached current desktop is sent after the
+  // refresh deadline
+  auto daemon_thread = serve_client (daemon, snapshots, refresh);
+  BOOST_TEST_MESSAGE ("Started thread");
 
-  daemon.running = false; // FIXME Ugly stopping thread
+  auto v_recv = client.get_desktops ();
+  BOOST_TEST_MESSAGE ("Got desktops");
+  daemon_thread.join ();
 
+  BOOST_REQUIRE_EQUAL (v_recv.size (), v.size ());
   for (size_t i = 0; i < v.size (); i++)
     {
       BOOST_CHECK_EQUAL (v_recv[i], v[i]);
@@ -68,47 +122,94 @@ BOOST_AUTO_TEST_CASE (send_vecotrs)
 }
 
 /**
- * If locks don't work, sent and received vectors will differ
+ * Desktops published while the client is served must not be mixed into the
+ * list being sent, except the recaptured current desktop
  */
 BOOST_AUTO_TEST_CASE (socket_race_condidion)
 {
   // Initialize test desktop structs
-  dexpo_pixmap d0{ 0, s_rnd (gen), s_rnd (gen), m_rnd (gen), "HDMI-0" };
-  dexpo_pixmap d1{ 1, s_rnd (gen), s_rnd (gen), m_rnd (gen), "VDI-1" };
-  dexpo_pixmap d2{ 2, s_rnd (gen), s_rnd (gen), m_rnd (gen), "DP-0" };
-  dexpo_pixmap d3{ 3, s_rnd (gen), s_rnd (gen), m_rnd (gen), "VGA-1" };
-
-  std::vector<dexpo_pixmap> v = { d0, d1, d2, d3 };
-  std::mutex v_lock;
-
-  auto daemon = dexpo_socket ();
-  std::thread daemon_thread (&dexpo_socket::send_pixmaps_on_event, &daemon,
-                             std::ref (v), std::ref (v_lock));
-  daemon_thread.detach ();
-  BOOST_TEST_MESSAGE ("Started thread");
+  std::vector<dxp_socket_desktop> v
+      = { random_desktop (0), random_desktop (1), random_desktop (2),
+          random_desktop (3) };
+
+  dxp_snapshots snapshots;
+  publish (snapshots, v);
+  dxp_refresh refresh;
+  refresh.current = 2;
 
-  auto client = dexpo_socket ();
+  auto daemon = dxp_socket ();
+  auto client = dxp_socket ();
   BOOST_TEST_MESSAGE ("Created client");
 
-  v_lock.lock ();
-  BOOST_TEST_MESSAGE ("Locked vector");
+  auto daemon_thread = serve_client (daemon, snapshots, refresh);
+  auto v_recv_future = std::async (std::launch::async,
+                                   [&] { return client.get_desktops (); });
+  BOOST_TEST_MESSAGE ("Asked for desktops");
 
-  auto v_recv_future = std::async (&dexpo_socket::get_pixmaps, &client);
-  BOOST_TEST_MESSAGE ("Asked for pixmaps");
+  // Capture requested by the server, as the daemon sees it
+  pollfd pfd{ refresh.fd, POLLIN, 0 };
+  BOOST_REQUIRE (poll (&pfd, 1, 1000) == 1);
+  const auto ticket = refresh.take ();
 
-  sleep (1);
+  // Other desktops change after the server loaded the list
+  std::this_thread::sleep_for (std::chrono::milliseconds (20));
+  auto fresh = v;
+  for (auto &d : fresh)
+    {
+      d = random_desktop (d.id);
+    }
+  publish (snapshots, fresh);
+  refresh.complete (ticket);
+  BOOST_TEST_MESSAGE ("Published new desktops");
 
-  v.erase (v.begin ());
-  BOOST_TEST_MESSAGE ("Removed element");
+  auto v_recv = v_recv_future.get ();
+  daemon_thread.join ();
 
-  v_lock.unlock ();
-  BOOST_TEST_MESSAGE ("Unlocked vector");
+  BOOST_REQUIRE_EQUAL (v_recv.size (), v.size ());
+  for (size_t i = 0; i < v.size (); i++)
+    {
+      BOOST_CHECK_EQUAL (v_recv[i], i == refresh.current ? fresh[i] : v[i]);
+    }
+}
 
-  auto v_recv = v_recv_future.get ();
+/**
+ * Levels are counted from the full size pixmap. Desktops with fewer levels
+ * than requested are sent with the smallest one
+ */
+BOOST_AUTO_TEST_CASE (send_levels)
+{
+  constexpr size_t levels = 2;
 
-  daemon.running = false;
+  // Initialize test desktop structs with a chain of smaller pixmaps
+  std::vector<dxp_socket_desktop> v
+      = { random_desktop (0), random_desktop (1), random_desktop (2) };
+  for (auto &d : v)
+    {
+      for (size_t i = 0; i < levels; i++)
+        {
+          d.mips.push_back (random_desktop (d.id));
+        }
+    }
+
+  dxp_snapshots snapshots;
+  publish (snapshots, v);
+  dxp_refresh refresh;
+  refresh.current = 1;
 
-  BOOST_TEST_MESSAGE ("Vector length: " << v.size ());
+  auto daemon = dxp_socket ();
 
-  BOOST_CHECK (v_recv[0] == v[0]);
+  for (int level : { 1, 2, 3, 255 })
+    {
+      auto client = dxp_socket ();
+      auto daemon_thread = serve_client (daemon, snapshots, refresh);
+      auto v_recv = client.get_desktops (uint8_t (level));
+      daemon_thread.join ();
+
+      const size_t mip = std::min (size_t (level), levels) - 1;
+      BOOST_REQUIRE_EQUAL (v_recv.size (), v.size ());
+      for (size_t i = 0; i < v.size (); i++)
+        {
+          BOOST_CHECK_EQUAL (v_recv[i], v[i].mips[mip]);
+        }
+    }
 }